@@ -0,0 +1,173 @@
+#ifndef PARATREET_EWALD_H_
+#define PARATREET_EWALD_H_
+
+#include "Paratreet.h"
+#include "CacheManager.h"
+#include "GravityKernels.h"
+#include "EwaldTable.h"
+#include <cmath>
+#include <utility>
+#include <vector>
+
+// Periodic gravity in the (cubic) universe box. The walk itself only sees
+// the nearest image of every source; the force of all further replicas,
+// plus the uniform background that keeps the infinite sum finite, is added
+// afterwards by ewaldCorrection() from a precomputed table instead of
+// summing over replicas per interaction.
+namespace gravity {
+
+inline bool periodic() {
+  static thread_local const paratreet::Configuration* config = &treespec.ckLocalBranch()->getConfiguration();
+  return config->periodic;
+}
+
+// The universe box of the current decomposition, which Particle::perturb
+// wraps positions into; periodic runs keep that of the first one
+inline const OrientedBox<Real>& periodicBox() {
+  static thread_local const BoundingBox* universe = &readers.ckLocalBranch()->universe;
+  return universe->box;
+}
+
+/// @brief Displacement shifted by whole box lengths into [-L/2, L/2]
+inline Vector3D<Real> nearestImage(Vector3D<Real> d) {
+  const Real length = periodicBox().size().x;
+  for (int dim = 0; dim < 3; dim++) {
+    d[dim] -= length * std::round(d[dim] / length);
+  }
+  return d;
+}
+
+/// @brief The image of position closest to reference
+inline Vector3D<Real> imageNear(const Vector3D<Real>& position, const Vector3D<Real>& reference) {
+  return reference + nearestImage(position - reference);
+}
+
+/// @brief Nodes whose particles span half the box or more have no single
+/// nearest image; the walk always opens them
+inline bool spansHalfBox(const OrientedBox<Real>& box) {
+  const Real half = periodicBox().size().x / 2;
+  Vector3D<Real> size = box.size();
+  return size.x >= half || size.y >= half || size.z >= half;
+}
+
+// Monopoles of the top of the cached tree, standing in for the particles
+// as Ewald sources; the correction is smooth enough that cells a few
+// levels down are accurate while keeping the pass O(N). It jumps where a
+// displacement crosses half the box, though, since the nearest image it
+// leaves out changes there: a cell straddling that boundary relative to a
+// target would put all of its mass on one image. ewaldCorrection() splits
+// those cells, down to cells of 1/2^max_split_depth of the box, below
+// which it uses the particles of local and cached leaves.
+// tests/unit/ewald_test measures the error of unsplit cells.
+struct EwaldSources {
+  static constexpr int max_depth = 3;
+  static constexpr int max_split_depth = 6;
+  std::vector<Node<CentroidData>*> cells;
+
+  // Placeholders carry no moments; a node is only split if none of its
+  // children is one, so that no mass goes missing
+  static bool hasMoments(Node<CentroidData>* node) {
+    return node == nullptr
+      || (node->type != Node<CentroidData>::Type::Remote
+       && node->type != Node<CentroidData>::Type::RemoteLeaf
+       && node->type != Node<CentroidData>::Type::RemoteAboveTPKey);
+  }
+
+  static bool canSplit(Node<CentroidData>* node, int depth_limit) {
+    bool split = node->depth < depth_limit && node->n_children > 0
+      && (node->type == Node<CentroidData>::Type::Internal
+       || node->type == Node<CentroidData>::Type::Boundary
+       || node->type == Node<CentroidData>::Type::CachedBoundary
+       || node->type == Node<CentroidData>::Type::CachedRemote);
+    for (int i = 0; split && i < node->n_children; i++) split = hasMoments(node->getChild(i));
+    return split;
+  }
+
+  void collect(Node<CentroidData>* node) {
+    if (node == nullptr || node->n_particles == 0) return;
+    if (canSplit(node, max_depth)) {
+      for (int i = 0; i < node->n_children; i++) collect(node->getChild(i));
+    }
+    else cells.push_back(node);
+  }
+
+  // Rebuilt once per iteration on each PE
+  static const EwaldSources& forIteration(int iter) {
+    static thread_local EwaldSources sources;
+    static thread_local int collected_iter = -1;
+    if (collected_iter != iter) {
+      sources.cells.clear();
+      auto root = centroid_cache.ckLocalBranch()->root;
+      sources.collect(root);
+      Real total = 0;
+      for (auto cell : sources.cells) total += cell->data.sum_mass;
+      if (std::abs(total - root->data.sum_mass) > 1e-4 * root->data.sum_mass) {
+        CkPrintf("EwaldSources: collected mass %g of %g on pe %d\n", total, root->data.sum_mass, CkMyPe());
+        CkAbort("EwaldSources: cached tree is missing mass");
+      }
+      collected_iter = iter;
+    }
+    return sources;
+  }
+};
+
+/// @brief Whether some displacement between the two boxes crosses half the
+/// box in some dimension
+inline bool straddlesHalfBox(const OrientedBox<Real>& source, const OrientedBox<Real>& target) {
+  const Real half = periodicBox().size().x / 2;
+  Vector3D<Real> d = nearestImage(source.center() - target.center());
+  Vector3D<Real> extent = (source.size() + target.size()) / 2;
+  for (int dim = 0; dim < 3; dim++) {
+    if (std::abs(d[dim]) + extent[dim] >= half) return true;
+  }
+  return false;
+}
+
+/// @brief Point masses standing in for node as seen from target: its
+/// monopole, or if it straddles the half box boundary relative to target,
+/// those of its children or particles
+inline void ewaldPoints(Node<CentroidData>* node, const OrientedBox<Real>& target,
+                        std::vector<std::pair<Vector3D<Real>, Real>>& points) {
+  if (node == nullptr || node->n_particles == 0) return;
+  if (straddlesHalfBox(node->data.box, target)) {
+    if (node->type == Node<CentroidData>::Type::Leaf || node->type == Node<CentroidData>::Type::CachedRemoteLeaf) {
+      for (int i = 0; i < node->n_particles; i++) {
+        points.emplace_back(node->particles()[i].position, node->particles()[i].mass);
+      }
+      return;
+    }
+    if (EwaldSources::canSplit(node, EwaldSources::max_split_depth)) {
+      for (int i = 0; i < node->n_children; i++) ewaldPoints(node->getChild(i), target, points);
+      return;
+    }
+  }
+  points.emplace_back(node->data.centroid, node->data.sum_mass);
+}
+
+/// @brief Adds the Ewald correction to every particle of leaf that took
+/// part in this iteration's force computation
+inline void ewaldCorrection(int iter, SpatialNode<CentroidData>& leaf) {
+  auto& config = treespec.ckLocalBranch()->getConfiguration();
+  const int active_rung = Particle::activeRung(iter % (1 << config.max_rung), config.max_rung);
+  auto& sources = EwaldSources::forIteration(iter);
+  auto& table = EwaldTable::get();
+  static thread_local std::vector<std::pair<Vector3D<Real>, Real>> points;
+  points.clear();
+  for (auto cell : sources.cells) ewaldPoints(cell, leaf.data.box, points);
+  const Real length = periodicBox().size().x;
+  const Real inv_length = 1 / length, inv_length2 = inv_length * inv_length;
+  for (int i = 0; i < leaf.n_particles; i++) {
+    auto& particle = leaf.particles()[i];
+    if (particle.rung < active_rung) continue;
+    Vector3D<Real> acc(0);
+    for (auto& point : points) {
+      Vector3D<Real> d = nearestImage(particle.position - point.first);
+      acc += point.second * table.lookup(d * inv_length);
+    }
+    leaf.applyAcceleration(i, acc * inv_length2);
+  }
+}
+
+} // namespace gravity
+
+#endif // PARATREET_EWALD_H_
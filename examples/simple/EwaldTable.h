@@ -0,0 +1,106 @@
+#ifndef PARATREET_EWALDTABLE_H_
+#define PARATREET_EWALDTABLE_H_
+
+#include "common.h"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace gravity {
+
+/// @brief Ewald correction to the Newtonian force of a unit mass in a unit
+/// periodic box, tabulated over one octant [0, 1/2]^3 of displacements.
+/// Each component is odd in its own coordinate and even in the others, so
+/// the octant covers every nearest-image displacement.
+class EwaldTable {
+public:
+  static constexpr int n_cells = 32; // table cells per half box
+
+  static const EwaldTable& get() {
+    static const EwaldTable table; // built once per process
+    return table;
+  }
+
+  /// @brief Correction at displacement d (target - source) in a unit box,
+  /// |d_i| <= 1/2, interpolated trilinearly
+  Vector3D<Real> lookup(const Vector3D<Real>& d) const {
+    Real u[3], sign[3];
+    int i0[3];
+    Real f[3];
+    for (int dim = 0; dim < 3; dim++) {
+      sign[dim] = d[dim] < 0 ? -1 : 1;
+      u[dim] = std::min(std::abs(d[dim]) * 2 * n_cells, (Real)n_cells);
+      i0[dim] = std::min((int)u[dim], n_cells - 1);
+      f[dim] = u[dim] - i0[dim];
+    }
+    Vector3D<Real> sum(0);
+    for (int corner = 0; corner < 8; corner++) {
+      int ix = i0[0] + (corner & 1), iy = i0[1] + ((corner >> 1) & 1), iz = i0[2] + (corner >> 2);
+      Real w = ((corner & 1) ? f[0] : 1 - f[0])
+             * (((corner >> 1) & 1) ? f[1] : 1 - f[1])
+             * ((corner >> 2) ? f[2] : 1 - f[2]);
+      sum += w * values[index(ix, iy, iz)];
+    }
+    return Vector3D<Real>(sign[0] * sum.x, sign[1] * sum.y, sign[2] * sum.z);
+  }
+
+private:
+  static constexpr int n_samples = n_cells + 1;
+  static constexpr double alpha = 2.0; // splitting scale, in inverse box lengths
+
+  EwaldTable() : values(n_samples * n_samples * n_samples, Vector3D<Real>(0)) {
+    for (int ix = 0; ix < n_samples; ix++) {
+      for (int iy = 0; iy < n_samples; iy++) {
+        for (int iz = 0; iz < n_samples; iz++) {
+          double x[3] = {0.5 * ix / n_cells, 0.5 * iy / n_cells, 0.5 * iz / n_cells};
+          double force[3];
+          correction(x, force);
+          values[index(ix, iy, iz)] = Vector3D<Real>(force[0], force[1], force[2]);
+        }
+      }
+    }
+  }
+
+  static int index(int ix, int iy, int iz) {return (ix * n_samples + iy) * n_samples + iz;}
+
+  // Real-space sum over nearby replicas plus the reciprocal-space sum, minus
+  // the Newtonian force of the nearest image (Hernquist, Bouchet & Suto 1991)
+  static void correction(const double x[3], double force[3]) {
+    const double r2 = x[0] * x[0] + x[1] * x[1] + x[2] * x[2];
+    for (int dim = 0; dim < 3; dim++) force[dim] = 0;
+    if (r2 == 0) return; // odd in every component
+    const double r = std::sqrt(r2);
+    for (int dim = 0; dim < 3; dim++) force[dim] = x[dim] / (r2 * r);
+    for (int nx = -2; nx <= 2; nx++) {
+      for (int ny = -2; ny <= 2; ny++) {
+        for (int nz = -2; nz <= 2; nz++) {
+          double dx[3] = {x[0] - nx, x[1] - ny, x[2] - nz};
+          double d2 = dx[0] * dx[0] + dx[1] * dx[1] + dx[2] * dx[2];
+          double d = std::sqrt(d2);
+          if (d > 2.6) continue; // erfc(alpha * d) below 1e-12
+          double val = std::erfc(alpha * d) + 2 * alpha * d / std::sqrt(M_PI) * std::exp(-alpha * alpha * d2);
+          for (int dim = 0; dim < 3; dim++) force[dim] -= dx[dim] / (d2 * d) * val;
+        }
+      }
+    }
+    for (int hx = -3; hx <= 3; hx++) {
+      for (int hy = -3; hy <= 3; hy++) {
+        for (int hz = -3; hz <= 3; hz++) {
+          int h2 = hx * hx + hy * hy + hz * hz;
+          if (h2 == 0 || h2 > 10) continue;
+          double hdotx = x[0] * hx + x[1] * hy + x[2] * hz;
+          double val = 2.0 / h2 * std::exp(-M_PI * M_PI * h2 / (alpha * alpha)) * std::sin(2 * M_PI * hdotx);
+          force[0] -= hx * val;
+          force[1] -= hy * val;
+          force[2] -= hz * val;
+        }
+      }
+    }
+  }
+
+  std::vector<Vector3D<Real>> values;
+};
+
+} // namespace gravity
+
+#endif // PARATREET_EWALDTABLE_H_
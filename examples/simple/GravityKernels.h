@@ -0,0 +1,341 @@
+#ifndef PARATREET_GRAVITYKERNELS_H_
+#define PARATREET_GRAVITYKERNELS_H_
+
+#include "common.h"
+#include "Particle.h"
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#if !defined(USE_DOUBLE_FP) && (defined(__AVX512F__) || defined(__AVX2__))
+#include <immintrin.h>
+#endif
+
+// Vectorized particle-particle (P2P) and node-particle (M2P) gravity kernels.
+// Particles are packed into an aligned structure-of-arrays scratch buffer
+// once per interaction so the inner loops run over contiguous lanes.
+// The AVX-512 / AVX2 paths are picked at compile time (e.g. build with
+// MAKE_OPTS=-march=native) and only for single precision Real; everything
+// else uses the scalar loops over the same SoA layout.
+namespace gravity {
+
+#if !defined(USE_DOUBLE_FP) && defined(__AVX512F__)
+  constexpr int simd_width = 16;
+#elif !defined(USE_DOUBLE_FP) && defined(__AVX2__)
+  constexpr int simd_width = 8;
+#else
+  constexpr int simd_width = 1;
+#endif
+
+struct SoALeaf {
+  Real* x = nullptr;
+  Real* y = nullptr;
+  Real* z = nullptr;
+  Real* mass = nullptr;
+  Real* ax = nullptr;
+  Real* ay = nullptr;
+  Real* az = nullptr;
+  int n = 0;
+  int n_padded = 0;
+
+  // Padding lanes get zero mass so they never contribute
+  void pack(const Particle* particles, int n_particles) {
+    n = n_particles;
+    n_padded = (n + simd_width - 1) / simd_width * simd_width;
+    const size_t needed = 7 * (size_t)n_padded + simd_width;
+    if (storage.size() < needed) storage.resize(needed);
+    auto addr = reinterpret_cast<std::uintptr_t>(storage.data());
+    const std::uintptr_t align = simd_width * sizeof(Real);
+    x    = reinterpret_cast<Real*>((addr + align - 1) / align * align);
+    y    = x + n_padded;
+    z    = y + n_padded;
+    mass = z + n_padded;
+    ax   = mass + n_padded;
+    ay   = ax + n_padded;
+    az   = ay + n_padded;
+    for (int i = 0; i < n; i++) {
+      x[i]    = particles[i].position.x;
+      y[i]    = particles[i].position.y;
+      z[i]    = particles[i].position.z;
+      mass[i] = particles[i].mass;
+    }
+    for (int i = n; i < n_padded; i++) {
+      x[i] = y[i] = z[i] = mass[i] = 0;
+    }
+  }
+
+  // Moves the packed particles, e.g. onto a periodic image
+  void translate(const Vector3D<Real>& by) {
+    if (by.x == 0 && by.y == 0 && by.z == 0) return;
+    for (int i = 0; i < n; i++) {
+      x[i] += by.x;
+      y[i] += by.y;
+      z[i] += by.z;
+    }
+  }
+
+private:
+  std::vector<Real> storage;
+};
+
+// Per-thread scratch, one for sources and one for targets
+inline SoALeaf& sourceScratch() {
+  static thread_local SoALeaf scratch;
+  return scratch;
+}
+
+inline SoALeaf& targetScratch() {
+  static thread_local SoALeaf scratch;
+  return scratch;
+}
+
+#if !defined(USE_DOUBLE_FP) && defined(__AVX2__) && !defined(__AVX512F__)
+inline float hsum(__m256 v) {
+  __m128 lo = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  __m128 sh = _mm_movehdup_ps(lo);
+  __m128 sums = _mm_add_ps(lo, sh);
+  sh = _mm_movehl_ps(sh, sums);
+  return _mm_cvtss_f32(_mm_add_ss(sums, sh));
+}
+#endif
+
+/// @brief Acceleration at pos due to every packed source particle.
+/// Pairs with rsq == 0 (including the particle itself) are masked out.
+inline Vector3D<Real> p2p(const SoALeaf& src, const Vector3D<Real>& pos) {
+#if !defined(USE_DOUBLE_FP) && defined(__AVX512F__)
+  const __m512 px = _mm512_set1_ps(pos.x), py = _mm512_set1_ps(pos.y), pz = _mm512_set1_ps(pos.z);
+  const __m512 zero = _mm512_setzero_ps();
+  __m512 acc_x = zero, acc_y = zero, acc_z = zero;
+  for (int j = 0; j < src.n_padded; j += simd_width) {
+    __m512 dx = _mm512_sub_ps(_mm512_load_ps(src.x + j), px);
+    __m512 dy = _mm512_sub_ps(_mm512_load_ps(src.y + j), py);
+    __m512 dz = _mm512_sub_ps(_mm512_load_ps(src.z + j), pz);
+    __m512 rsq = _mm512_fmadd_ps(dz, dz, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dx, dx)));
+    __mmask16 nonzero = _mm512_cmp_ps_mask(rsq, zero, _CMP_GT_OQ);
+    __m512 scale = _mm512_maskz_div_ps(nonzero, _mm512_load_ps(src.mass + j),
+                                       _mm512_mul_ps(rsq, _mm512_sqrt_ps(rsq)));
+    acc_x = _mm512_fmadd_ps(dx, scale, acc_x);
+    acc_y = _mm512_fmadd_ps(dy, scale, acc_y);
+    acc_z = _mm512_fmadd_ps(dz, scale, acc_z);
+  }
+  return Vector3D<Real>(_mm512_reduce_add_ps(acc_x), _mm512_reduce_add_ps(acc_y), _mm512_reduce_add_ps(acc_z));
+#elif !defined(USE_DOUBLE_FP) && defined(__AVX2__)
+  const __m256 px = _mm256_set1_ps(pos.x), py = _mm256_set1_ps(pos.y), pz = _mm256_set1_ps(pos.z);
+  const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+  __m256 acc_x = zero, acc_y = zero, acc_z = zero;
+  for (int j = 0; j < src.n_padded; j += simd_width) {
+    __m256 dx = _mm256_sub_ps(_mm256_load_ps(src.x + j), px);
+    __m256 dy = _mm256_sub_ps(_mm256_load_ps(src.y + j), py);
+    __m256 dz = _mm256_sub_ps(_mm256_load_ps(src.z + j), pz);
+    __m256 rsq = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_add_ps(_mm256_mul_ps(dy, dy), _mm256_mul_ps(dz, dz)));
+    __m256 nonzero = _mm256_cmp_ps(rsq, zero, _CMP_GT_OQ);
+    __m256 safe = _mm256_blendv_ps(one, rsq, nonzero);
+    __m256 scale = _mm256_div_ps(_mm256_load_ps(src.mass + j), _mm256_mul_ps(safe, _mm256_sqrt_ps(safe)));
+    scale = _mm256_and_ps(scale, nonzero);
+    acc_x = _mm256_add_ps(acc_x, _mm256_mul_ps(dx, scale));
+    acc_y = _mm256_add_ps(acc_y, _mm256_mul_ps(dy, scale));
+    acc_z = _mm256_add_ps(acc_z, _mm256_mul_ps(dz, scale));
+  }
+  return Vector3D<Real>(hsum(acc_x), hsum(acc_y), hsum(acc_z));
+#else
+  Real acc_x = 0, acc_y = 0, acc_z = 0;
+  for (int j = 0; j < src.n; j++) {
+    Real dx = src.x[j] - pos.x, dy = src.y[j] - pos.y, dz = src.z[j] - pos.z;
+    Real rsq = dx * dx + dy * dy + dz * dz;
+    if (rsq != 0) {
+      Real scale = src.mass[j] / (rsq * std::sqrt(rsq));
+      acc_x += dx * scale;
+      acc_y += dy * scale;
+      acc_z += dz * scale;
+    }
+  }
+  return Vector3D<Real>(acc_x, acc_y, acc_z);
+#endif
+}
+
+/// @brief Fills tgt.ax/ay/az with the acceleration of every packed target
+/// due to a node with the given mass and reduced quadrupole (xx, xy, xz,
+/// yy, yz, zz) about centroid. With d = centroid - target this is
+///   d (M / r^3 + 5/2 dQd / r^7) - Q d / r^5.
+/// Targets sitting on the centroid get zero.
+inline void m2p(const Vector3D<Real>& centroid, Real mass, const Real* quad, SoALeaf& tgt) {
+#if !defined(USE_DOUBLE_FP) && defined(__AVX512F__)
+  const __m512 cx = _mm512_set1_ps(centroid.x), cy = _mm512_set1_ps(centroid.y), cz = _mm512_set1_ps(centroid.z);
+  const __m512 m = _mm512_set1_ps(mass), zero = _mm512_setzero_ps(), one = _mm512_set1_ps(1.0f);
+  const __m512 qxx = _mm512_set1_ps(quad[0]), qxy = _mm512_set1_ps(quad[1]), qxz = _mm512_set1_ps(quad[2]);
+  const __m512 qyy = _mm512_set1_ps(quad[3]), qyz = _mm512_set1_ps(quad[4]), qzz = _mm512_set1_ps(quad[5]);
+  const __m512 five_halves = _mm512_set1_ps(2.5f);
+  for (int i = 0; i < tgt.n_padded; i += simd_width) {
+    __m512 dx = _mm512_sub_ps(cx, _mm512_load_ps(tgt.x + i));
+    __m512 dy = _mm512_sub_ps(cy, _mm512_load_ps(tgt.y + i));
+    __m512 dz = _mm512_sub_ps(cz, _mm512_load_ps(tgt.z + i));
+    __m512 rsq = _mm512_fmadd_ps(dz, dz, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dx, dx)));
+    __mmask16 nonzero = _mm512_cmp_ps_mask(rsq, zero, _CMP_GT_OQ);
+    __m512 inv_r = _mm512_maskz_div_ps(nonzero, one, _mm512_sqrt_ps(rsq));
+    __m512 inv_r2 = _mm512_mul_ps(inv_r, inv_r);
+    __m512 inv_r3 = _mm512_mul_ps(inv_r, inv_r2);
+    __m512 inv_r5 = _mm512_mul_ps(inv_r3, inv_r2);
+    __m512 qdx = _mm512_fmadd_ps(qxz, dz, _mm512_fmadd_ps(qxy, dy, _mm512_mul_ps(qxx, dx)));
+    __m512 qdy = _mm512_fmadd_ps(qyz, dz, _mm512_fmadd_ps(qyy, dy, _mm512_mul_ps(qxy, dx)));
+    __m512 qdz = _mm512_fmadd_ps(qzz, dz, _mm512_fmadd_ps(qyz, dy, _mm512_mul_ps(qxz, dx)));
+    __m512 dqd = _mm512_fmadd_ps(dz, qdz, _mm512_fmadd_ps(dy, qdy, _mm512_mul_ps(dx, qdx)));
+    __m512 scale = _mm512_fmadd_ps(_mm512_mul_ps(five_halves, dqd), _mm512_mul_ps(inv_r5, inv_r2), _mm512_mul_ps(m, inv_r3));
+    _mm512_store_ps(tgt.ax + i, _mm512_fmsub_ps(dx, scale, _mm512_mul_ps(qdx, inv_r5)));
+    _mm512_store_ps(tgt.ay + i, _mm512_fmsub_ps(dy, scale, _mm512_mul_ps(qdy, inv_r5)));
+    _mm512_store_ps(tgt.az + i, _mm512_fmsub_ps(dz, scale, _mm512_mul_ps(qdz, inv_r5)));
+  }
+#elif !defined(USE_DOUBLE_FP) && defined(__AVX2__)
+  const __m256 cx = _mm256_set1_ps(centroid.x), cy = _mm256_set1_ps(centroid.y), cz = _mm256_set1_ps(centroid.z);
+  const __m256 m = _mm256_set1_ps(mass), zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+  const __m256 qxx = _mm256_set1_ps(quad[0]), qxy = _mm256_set1_ps(quad[1]), qxz = _mm256_set1_ps(quad[2]);
+  const __m256 qyy = _mm256_set1_ps(quad[3]), qyz = _mm256_set1_ps(quad[4]), qzz = _mm256_set1_ps(quad[5]);
+  const __m256 five_halves = _mm256_set1_ps(2.5f);
+  for (int i = 0; i < tgt.n_padded; i += simd_width) {
+    __m256 dx = _mm256_sub_ps(cx, _mm256_load_ps(tgt.x + i));
+    __m256 dy = _mm256_sub_ps(cy, _mm256_load_ps(tgt.y + i));
+    __m256 dz = _mm256_sub_ps(cz, _mm256_load_ps(tgt.z + i));
+    __m256 rsq = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_add_ps(_mm256_mul_ps(dy, dy), _mm256_mul_ps(dz, dz)));
+    __m256 nonzero = _mm256_cmp_ps(rsq, zero, _CMP_GT_OQ);
+    __m256 safe = _mm256_blendv_ps(one, rsq, nonzero);
+    __m256 inv_r = _mm256_and_ps(_mm256_div_ps(one, _mm256_sqrt_ps(safe)), nonzero);
+    __m256 inv_r2 = _mm256_mul_ps(inv_r, inv_r);
+    __m256 inv_r3 = _mm256_mul_ps(inv_r, inv_r2);
+    __m256 inv_r5 = _mm256_mul_ps(inv_r3, inv_r2);
+    __m256 qdx = _mm256_add_ps(_mm256_mul_ps(qxx, dx), _mm256_add_ps(_mm256_mul_ps(qxy, dy), _mm256_mul_ps(qxz, dz)));
+    __m256 qdy = _mm256_add_ps(_mm256_mul_ps(qxy, dx), _mm256_add_ps(_mm256_mul_ps(qyy, dy), _mm256_mul_ps(qyz, dz)));
+    __m256 qdz = _mm256_add_ps(_mm256_mul_ps(qxz, dx), _mm256_add_ps(_mm256_mul_ps(qyz, dy), _mm256_mul_ps(qzz, dz)));
+    __m256 dqd = _mm256_add_ps(_mm256_mul_ps(dx, qdx), _mm256_add_ps(_mm256_mul_ps(dy, qdy), _mm256_mul_ps(dz, qdz)));
+    __m256 scale = _mm256_add_ps(_mm256_mul_ps(m, inv_r3),
+                                 _mm256_mul_ps(_mm256_mul_ps(five_halves, dqd), _mm256_mul_ps(inv_r5, inv_r2)));
+    _mm256_store_ps(tgt.ax + i, _mm256_sub_ps(_mm256_mul_ps(dx, scale), _mm256_mul_ps(qdx, inv_r5)));
+    _mm256_store_ps(tgt.ay + i, _mm256_sub_ps(_mm256_mul_ps(dy, scale), _mm256_mul_ps(qdy, inv_r5)));
+    _mm256_store_ps(tgt.az + i, _mm256_sub_ps(_mm256_mul_ps(dz, scale), _mm256_mul_ps(qdz, inv_r5)));
+  }
+#else
+  for (int i = 0; i < tgt.n; i++) {
+    Real dx = centroid.x - tgt.x[i], dy = centroid.y - tgt.y[i], dz = centroid.z - tgt.z[i];
+    Real rsq = dx * dx + dy * dy + dz * dz;
+    if (rsq == 0) {
+      tgt.ax[i] = tgt.ay[i] = tgt.az[i] = 0;
+      continue;
+    }
+    Real inv_r = 1 / std::sqrt(rsq), inv_r2 = inv_r * inv_r;
+    Real inv_r3 = inv_r * inv_r2, inv_r5 = inv_r3 * inv_r2;
+    Real qdx = quad[0] * dx + quad[1] * dy + quad[2] * dz;
+    Real qdy = quad[1] * dx + quad[3] * dy + quad[4] * dz;
+    Real qdz = quad[2] * dx + quad[4] * dy + quad[5] * dz;
+    Real dqd = dx * qdx + dy * qdy + dz * qdz;
+    Real scale = mass * inv_r3 + Real(2.5) * dqd * inv_r5 * inv_r2;
+    tgt.ax[i] = dx * scale - qdx * inv_r5;
+    tgt.ay[i] = dy * scale - qdy * inv_r5;
+    tgt.az[i] = dz * scale - qdz * inv_r5;
+  }
+#endif
+}
+
+/// @brief Second order Taylor expansion of the acceleration about center,
+/// a(center + d) = a + J d + K d d / 2, accumulated from far sources (M2L),
+/// shifted down to child centers (L2L) and evaluated at particles (L2P).
+struct LocalExpansion {
+  Vector3D<Real> center;
+  Real a[3] = {};
+  Real j[3][3] = {};
+  Real k[3][3][3] = {};
+  bool empty = true;
+
+  void reset(const Vector3D<Real>& centeri) {
+    *this = LocalExpansion();
+    center = centeri;
+    empty = false;
+  }
+
+  /// @brief Adds the field of a point mass at source
+  void addMonopole(const Vector3D<Real>& source, Real mass) {
+    const Vector3D<Real> r = center - source;
+    const Real rsq = r.lengthSquared();
+    if (rsq == 0) return;
+    const Real inv_r2 = 1 / rsq, inv_r3 = inv_r2 / std::sqrt(rsq);
+    const Real inv_r5 = inv_r3 * inv_r2, inv_r7 = inv_r5 * inv_r2;
+    for (int x = 0; x < 3; x++) {
+      a[x] -= mass * r[x] * inv_r3;
+      for (int y = 0; y < 3; y++) {
+        j[x][y] -= mass * ((x == y) * inv_r3 - 3 * r[x] * r[y] * inv_r5);
+        for (int z = 0; z < 3; z++) {
+          k[x][y][z] -= mass * (15 * r[x] * r[y] * r[z] * inv_r7
+            - 3 * ((x == y) * r[z] + (x == z) * r[y] + (y == z) * r[x]) * inv_r5);
+        }
+      }
+    }
+  }
+
+  /// @brief Adds the field of a reduced quadrupole (xx, xy, xz, yy, yz, zz)
+  /// about source, from the derivatives of its potential -r Q r / (2 r^5);
+  /// with addMonopole this matches m2p() up to the expansion's order
+  void addQuadrupole(const Vector3D<Real>& source, const Real* quad) {
+    const Vector3D<Real> r = center - source;
+    const Real rsq = r.lengthSquared();
+    if (rsq == 0) return;
+    const Real q[3][3] = {{quad[0], quad[1], quad[2]}, {quad[1], quad[3], quad[4]}, {quad[2], quad[4], quad[5]}};
+    Real qr[3], rqr = 0;
+    for (int x = 0; x < 3; x++) {
+      qr[x] = q[x][0] * r[0] + q[x][1] * r[1] + q[x][2] * r[2];
+      rqr += r[x] * qr[x];
+    }
+    const Real inv_r2 = 1 / rsq, inv_r5 = inv_r2 * inv_r2 / std::sqrt(rsq);
+    const Real inv_r7 = inv_r5 * inv_r2, inv_r9 = inv_r7 * inv_r2, inv_r11 = inv_r9 * inv_r2;
+    // First and second derivatives of r^-5
+    Real f1[3], f2[3][3];
+    for (int x = 0; x < 3; x++) {
+      f1[x] = -5 * r[x] * inv_r7;
+      for (int y = 0; y < 3; y++) f2[x][y] = 35 * r[x] * r[y] * inv_r9 - 5 * (x == y) * inv_r7;
+    }
+    for (int x = 0; x < 3; x++) {
+      a[x] += qr[x] * inv_r5 + rqr * f1[x] / 2;
+      for (int y = 0; y < 3; y++) {
+        j[x][y] += q[x][y] * inv_r5 + qr[x] * f1[y] + qr[y] * f1[x] + rqr * f2[x][y] / 2;
+        for (int z = 0; z < 3; z++) {
+          const Real f3 = 35 * ((x == y) * r[z] + (x == z) * r[y] + (y == z) * r[x]) * inv_r9
+            - 315 * r[x] * r[y] * r[z] * inv_r11;
+          k[x][y][z] += q[x][y] * f1[z] + q[x][z] * f1[y] + q[y][z] * f1[x]
+            + qr[x] * f2[y][z] + qr[y] * f2[x][z] + qr[z] * f2[x][y] + rqr * f3 / 2;
+        }
+      }
+    }
+  }
+
+  Vector3D<Real> evaluate(const Vector3D<Real>& position) const {
+    const Vector3D<Real> d = position - center;
+    Vector3D<Real> acc(0);
+    for (int x = 0; x < 3; x++) {
+      Real sum = a[x];
+      for (int y = 0; y < 3; y++) {
+        Real kd = 0;
+        for (int z = 0; z < 3; z++) kd += k[x][y][z] * d[z];
+        sum += (j[x][y] + kd / 2) * d[y];
+      }
+      acc[x] = sum;
+    }
+    return acc;
+  }
+
+  /// @brief Adds this expansion, re-centred on other.center, to other
+  void shiftInto(LocalExpansion& other) const {
+    const Vector3D<Real> e = other.center - center;
+    const Vector3D<Real> shifted = evaluate(other.center);
+    for (int x = 0; x < 3; x++) {
+      other.a[x] += shifted[x];
+      for (int y = 0; y < 3; y++) {
+        Real ke = 0;
+        for (int z = 0; z < 3; z++) {
+          ke += k[x][y][z] * e[z];
+          other.k[x][y][z] += k[x][y][z];
+        }
+        other.j[x][y] += j[x][y] + ke;
+      }
+    }
+  }
+};
+
+} // namespace gravity
+
+#endif // PARATREET_GRAVITYKERNELS_H_
@@ -4,6 +4,8 @@
 #include "paratreet.decl.h"
 #include "common.h"
 #include "Space.h"
+#include "GravityKernels.h"
+#include "Ewald.h"
 #include <cmath>
 
 extern CProxy_Resumer<CentroidData> centroid_resumer;
@@ -17,14 +19,19 @@ private:
   static constexpr Real theta = 0.7;
   static constexpr int  nMinParticleNode = 6;
 
+  // The source centroid, or with periodic boundaries its image nearest
+  // the target
+  static Vector3D<Real> sourceCentroid(const SpatialNode<CentroidData>& source, const SpatialNode<CentroidData>& target) {
+    if (!gravity::periodic()) return source.data.centroid;
+    return gravity::imageNear(source.data.centroid, target.data.box.center());
+  }
+
   static void addGravity(const SpatialNode<CentroidData>& source, SpatialNode<CentroidData>& target) {
+    auto& tgt = gravity::targetScratch();
+    tgt.pack(target.particles(), target.n_particles);
+    gravity::m2p(sourceCentroid(source, target), source.data.sum_mass, source.data.quadrupole, tgt);
     for (int i = 0; i < target.n_particles; i++) {
-      Vector3D<Real> diff = source.data.centroid - target.particles()[i].position;
-      Real rsq = diff.lengthSquared();
-      if (rsq != 0) {
-        Vector3D<Real> accel = diff * (source.data.sum_mass / (rsq * sqrt(rsq)));
-        target.applyAcceleration(i, accel);
-      }
+      target.applyAcceleration(i, Vector3D<Real>(tgt.ax[i], tgt.ay[i], tgt.az[i]));
     }
   }
 
@@ -32,23 +39,24 @@ public:
   /// @brief We've hit a leaf: N^2 interactions between all particles
   /// in the target and node.
   static void leaf(const SpatialNode<CentroidData>& source, SpatialNode<CentroidData>& target) {
-      // addGravity(source, target);
+    auto& src = gravity::sourceScratch();
+    src.pack(source.particles(), source.n_particles);
+    if (gravity::periodic()) {
+      Vector3D<Real> center = source.data.box.center();
+      src.translate(gravity::imageNear(center, target.data.box.center()) - center);
+    }
     for (int i = 0; i < target.n_particles; i++) {
-      Vector3D<Real> accel(0.0);
-      for (int j = 0; j < source.n_particles; j++) {
-          Vector3D<Real> diff = source.particles()[j].position - target.particles()[i].position;
-          Real rsq = diff.lengthSquared();
-          if (rsq != 0) {
-              accel += diff * (source.particles()[j].mass / (rsq * sqrt(rsq)));
-          }
-      }
-      target.applyAcceleration(i, accel);
+      if (!target.particles()[i].isActive()) continue;
+      target.applyAcceleration(i, gravity::p2p(src, target.particles()[i].position));
     }
   }
 
   static bool open(const SpatialNode<CentroidData>& source, SpatialNode<CentroidData>& target) {
     if (source.n_particles <= nMinParticleNode) return true;
-    return Space::intersect(target.data.box, source.data.centroid, source.data.rsq);
+    if (!gravity::periodic()) return Space::intersect(target.data.box, source.data.centroid, source.data.rsq);
+    // Periodic: test the source image nearest to the target
+    if (gravity::spansHalfBox(source.data.box) || gravity::spansHalfBox(target.data.box)) return true;
+    return Space::intersect(target.data.box, sourceCentroid(source, target), source.data.rsq);
   }
 
   static void node(const SpatialNode<CentroidData>& source, SpatialNode<CentroidData>& target) {
@@ -57,31 +65,44 @@ public:
     }
   }
 
+  // The dual walk treats a false cell() as far field for every bucket under
+  // target, so this has to use the same box test as open(): testing only the
+  // corners misses sources close to a face of a large target box.
   static bool cell(const SpatialNode<CentroidData>& source, SpatialNode<CentroidData>& target) {
-    // find the closest particle in target to source's center
-    // check all eight corners of bounding box
-    // return true if one corner is within total_volume of node
-    // else return false
-
-    const OrientedBox<Real> box = target.data.box;
-    if (box.contains(source.data.centroid)) return true;
-
-    for (int i = 0; i < 2; i++) {
-      for (int j = 0; j < 2; j++) {
-        for (int k = 0; k < 2; k++) {
-          Vector3D<Real> corner;
-          corner.x = (i) ? box.greater_corner.x : box.lesser_corner.x;
-          corner.y = (j) ? box.greater_corner.y : box.lesser_corner.y;
-          corner.z = (k) ? box.greater_corner.z : box.lesser_corner.z;
-          Vector3D<Real> dr = source.data.centroid - corner;
-          Real dsq = dr.lengthSquared();
-          if (theta * dsq < source.data.rsq) {
-            return true;
-          } 
-        }
-      }
+    return open(source, target);
+  }
+
+  // Fast multipole mode (Partition::startFMM)
+  using Local = gravity::LocalExpansion;
+
+  // A well separated source may go into the target's local expansion if
+  // the target is also small compared to their distance
+  static bool useLocal(const SpatialNode<CentroidData>& source, const SpatialNode<CentroidData>& target) {
+    Real dsq = (sourceCentroid(source, target) - target.data.box.center()).lengthSquared();
+    Real target_rsq = target.data.box.size().lengthSquared() / 4;
+    return target_rsq < theta * theta * dsq;
+  }
+
+  static void m2l(const SpatialNode<CentroidData>& source, const SpatialNode<CentroidData>& target, Local& local) {
+    if (source.n_particles == 0) return;
+    if (local.empty) local.reset(target.data.box.center());
+    const Vector3D<Real> centroid = sourceCentroid(source, target);
+    local.addMonopole(centroid, source.data.sum_mass);
+    local.addQuadrupole(centroid, source.data.quadrupole);
+  }
+
+  static void l2l(const Local& parent, const SpatialNode<CentroidData>& target, Local& local) {
+    if (parent.empty) return;
+    if (local.empty) local.reset(target.data.box.center());
+    parent.shiftInto(local);
+  }
+
+  static void l2p(const Local& local, SpatialNode<CentroidData>& target) {
+    if (local.empty) return;
+    for (int i = 0; i < target.n_particles; i++) {
+      if (!target.particles()[i].isActive()) continue;
+      target.applyAcceleration(i, local.evaluate(target.particles()[i].position));
     }
-    return false;
   }
 
 };
@@ -0,0 +1,145 @@
+#ifndef PARATREET_BUCKETSET_H_
+#define PARATREET_BUCKETSET_H_
+
+#include "BumpArena.h"
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Representations of the set of buckets still active at a node of a
+// traversal. Both are plain views into a TraversalArenas of their Word type,
+// so they are copied by value. filter() calls keep(bucket) on every member
+// and returns the subset for which it was true, which becomes the set
+// inherited by the node's children.
+
+// Explicit list of bucket indices
+struct BucketList {
+  using Word = int;
+
+  Word* buckets;
+  int size;
+
+  static BucketList all(int n_buckets, BumpArena<Word>& arena) {
+    return range(n_buckets, 0, n_buckets, arena);
+  }
+
+  // Buckets [begin, end) of n_buckets
+  static BucketList range(int n_buckets, int begin, int end, BumpArena<Word>& arena) {
+    BucketList set {arena.allocate(end - begin), end - begin};
+    for (int i = begin; i < end; i++) set.buckets[i - begin] = i;
+    return set;
+  }
+
+  static BucketList fromList(int n_buckets, const std::vector<int>& list, BumpArena<Word>& arena) {
+    BucketList set {arena.allocate(list.size()), (int)list.size()};
+    std::copy(list.begin(), list.end(), set.buckets);
+    return set;
+  }
+
+  int count() const {return size;}
+
+  BucketList copy(BumpArena<Word>& arena) const {
+    BucketList set {arena.allocate(size), size};
+    std::copy(buckets, buckets + size, set.buckets);
+    return set;
+  }
+
+  template <typename Fn>
+  void forEach(Fn&& fn) const {
+    for (int i = 0; i < size; i++) fn(buckets[i]);
+  }
+
+  template <typename Fn>
+  BucketList filter(BumpArena<Word>& arena, Fn&& keep) const {
+    BucketList set {arena.allocate(size), 0};
+    for (int i = 0; i < size; i++) {
+      if (keep(buckets[i])) set.buckets[set.size++] = buckets[i];
+    }
+    return set;
+  }
+};
+
+// Dense bitset over the partition's buckets. Only the words in [lo, hi)
+// are meaningful (the rest are never read or written), which keeps sparse
+// sets deep in the tree cheap to scan.
+struct BucketBits {
+  using Word = uint64_t;
+  static constexpr int word_bits = 64;
+
+  Word* words;
+  int n_words;
+  int lo, hi;
+  int n_set;
+
+  static BucketBits all(int n_buckets, BumpArena<Word>& arena) {
+    return range(n_buckets, 0, n_buckets, arena);
+  }
+
+  static BucketBits range(int n_buckets, int begin, int end, BumpArena<Word>& arena) {
+    BucketBits set = empty(n_buckets, arena);
+    for (int i = begin; i < end; i++) set.add(i);
+    return set;
+  }
+
+  static BucketBits fromList(int n_buckets, const std::vector<int>& list, BumpArena<Word>& arena) {
+    BucketBits set = empty(n_buckets, arena);
+    for (auto bucket : list) set.add(bucket);
+    return set;
+  }
+
+  int count() const {return n_set;}
+
+  BucketBits copy(BumpArena<Word>& arena) const {
+    BucketBits set {arena.allocate(n_words), n_words, lo, hi, n_set};
+    std::copy(words + lo, words + hi, set.words + lo);
+    return set;
+  }
+
+  template <typename Fn>
+  void forEach(Fn&& fn) const {
+    for (int w = lo; w < hi; w++) {
+      for (Word bits = words[w]; bits; bits &= bits - 1) {
+        fn(w * word_bits + __builtin_ctzll(bits));
+      }
+    }
+  }
+
+  template <typename Fn>
+  BucketBits filter(BumpArena<Word>& arena, Fn&& keep) const {
+    BucketBits set {arena.allocate(n_words), n_words, hi, lo, 0};
+    for (int w = lo; w < hi; w++) {
+      Word kept = 0;
+      for (Word bits = words[w]; bits; bits &= bits - 1) {
+        const int bit = __builtin_ctzll(bits);
+        if (keep(w * word_bits + bit)) kept |= Word(1) << bit;
+      }
+      set.words[w] = kept;
+      if (kept) {
+        set.lo = std::min(set.lo, w);
+        set.hi = w + 1;
+        set.n_set += __builtin_popcountll(kept);
+      }
+    }
+    if (set.n_set == 0) set.lo = set.hi = lo;
+    return set;
+  }
+
+private:
+  static BucketBits empty(int n_buckets, BumpArena<Word>& arena) {
+    const int n_words = (n_buckets + word_bits - 1) / word_bits;
+    BucketBits set {arena.allocate(n_words), n_words, 0, 0, 0};
+    std::fill(set.words, set.words + n_words, Word(0));
+    return set;
+  }
+
+  // Buckets must be added in increasing order
+  void add(int bucket) {
+    const int w = bucket / word_bits;
+    if (n_set == 0) lo = w;
+    hi = w + 1;
+    words[w] |= Word(1) << (bucket % word_bits);
+    n_set++;
+  }
+};
+
+#endif // PARATREET_BUCKETSET_H_
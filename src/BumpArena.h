@@ -0,0 +1,73 @@
+#ifndef PARATREET_BUMPARENA_H_
+#define PARATREET_BUMPARENA_H_
+
+#include <algorithm>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+// Bump allocator for short-lived arrays of trivial types (e.g. the bucket
+// sets of a traversal). Blocks are kept across reset() so that once the
+// arena has grown to the working set, allocation never touches malloc.
+// mark()/rewind() release everything allocated after the mark, which lets
+// a depth-first walk recycle memory in LIFO order.
+template <typename T>
+class BumpArena {
+  static_assert(std::is_trivially_destructible<T>::value, "BumpArena only holds trivial types");
+
+public:
+  struct Mark {
+    size_t block;
+    size_t offset;
+  };
+
+  explicit BumpArena(size_t block_sizei = 1 << 16) : block_size(block_sizei) {}
+
+  T* allocate(size_t n) {
+    while (curr < blocks.size()) {
+      auto& block = blocks[curr];
+      if (offset + n <= block.size) {
+        T* ptr = block.data.get() + offset;
+        offset += n;
+        return ptr;
+      }
+      curr++;
+      offset = 0;
+    }
+    blocks.push_back(Block(std::max(n, block_size)));
+    offset = n;
+    return blocks.back().data.get();
+  }
+
+  Mark mark() const {return {curr, offset};}
+  void rewind(const Mark& m) {curr = m.block; offset = m.offset;}
+  void reset() {curr = 0; offset = 0;}
+
+  size_t capacity() const {
+    size_t total = 0;
+    for (auto && block : blocks) total += block.size;
+    return total;
+  }
+
+private:
+  struct Block {
+    std::unique_ptr<T[]> data;
+    size_t size;
+    Block(size_t sizei) : data(new T[sizei]), size(sizei) {}
+  };
+
+  std::vector<Block> blocks;
+  size_t block_size;
+  size_t curr = 0;
+  size_t offset = 0;
+};
+
+// Arenas behind the active bucket sets of a traversal
+template <typename T>
+struct TraversalArenas {
+  BumpArena<T> scratch; // recycled as the walk unwinds
+  BumpArena<T> waiting; // sets parked on remote nodes, kept until reset
+  void reset() {scratch.reset(); waiting.reset();}
+};
+
+#endif // PARATREET_BUMPARENA_H_
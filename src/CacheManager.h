@@ -6,9 +6,17 @@
 #include "Utility.h"
 #include "templates.h"
 #include "MultiData.h"
+#include "WorkPool.h"
+#include "SubtreeMsg.h"
+#include "ShardedMap.h"
 
+#include <algorithm>
+#include <limits>
+#include <list>
 #include <map>
+#include <set>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <mutex>
 
@@ -17,18 +25,96 @@ extern CProxy_TreeSpec treespec;
 template <typename Data>
 class CacheManager : public CBase_CacheManager<Data> {
 public:
-  std::mutex maps_lock;
+  std::mutex maps_lock; // cached tree bookkeeping below, in nodegroup mode
   Node<Data>* root = nullptr;
-  using NodeLookup = std::unordered_map<Key, Node<Data>*>;
+  // Written by Subtrees and Partitions on every PE of the process while the
+  // tree is built, so each is sharded rather than behind maps_lock
+  using NodeLookup = ShardedMap<Key, Node<Data>*>;
   NodeLookup local_tps;
   NodeLookup leaf_lookup;
-  std::map<Key, std::vector<int>> subtree_copy_started;
-  std::map<int, Partition<Data>*> partition_lookup; // managed by Partition
+  ShardedMap<Key, std::vector<int>> subtree_copy_started;
+  ShardedMap<int, Partition<Data>*> partition_lookup; // managed by Partition
   std::set<Key> prefetch_set;
+  // Per-rank contributions to prefetch_set and nodewide_data, folded in
+  // by mergePrefetch()
+  std::vector<std::set<Key>> rank_prefetch_set;
+  std::vector<Data> rank_nodewide_data;
   std::vector<std::vector<Node<Data>*>> delete_at_end;
   CProxy_Resumer<Data> r_proxy;
   Data nodewide_data;
   std::atomic<size_t> num_buckets = ATOMIC_VAR_INIT(0ul);
+  WorkPool work_pool; // traversal work that idle PEs can steal
+
+  // Memory budget (Configuration::cache_budget_mb). Every requested subtree is
+  // one unit of eviction; evicted units are replaced by placeholders, so a
+  // walk that needs them again simply refetches. Sizes are measured once,
+  // on arrival. All of this is guarded by maps_lock.
+  struct Unit {
+    Node<Data>* node; // null once evicted along with an enclosing unit
+    size_t bytes;
+  };
+  size_t live_bytes = 0;    // units in the tree
+  size_t retired_bytes = 0; // evicted units not yet reclaimed
+  std::list<Unit> units; // in arrival order
+  std::unordered_map<Node<Data>*, typename std::list<Unit>::iterator> unit_pos;
+
+  // Epoch-based reclamation: walks that started before a unit was evicted
+  // may still hold pointers into it, so it is deleted only once they end
+  struct Retired {
+    size_t epoch;
+    Node<Data>* node;
+    size_t bytes; // with the units that arrived into it after eviction
+  };
+  size_t epoch = 0;
+  std::multiset<size_t> walk_epochs; // start epochs of running walks
+  std::vector<Retired> retired;
+  // Replies for units that were already back in the tree: after an
+  // eviction two walks can refetch the same unit before either reply lands
+  std::atomic<size_t> n_duplicates = ATOMIC_VAR_INIT(0ul);
+
+  // Cross-iteration persistence (Configuration::persist_cache). Each unit is
+  // kept through destroy() as the message it arrived in, with the owner's
+  // digest of every node. The next iteration asks the owner for a delta
+  // against that copy: nodes whose digests still match are not resent.
+  // stale_units is only written between iterations, so walks read it freely.
+  ShardedMap<Key, std::vector<uint64_t>> unit_digests; // live units
+  std::unordered_map<Key, MultiData<Data>> stale_units; // last iteration's
+  // Delta replies this iteration: nodes they covered and nodes reused
+  std::atomic<size_t> n_delta_nodes = ATOMIC_VAR_INIT(0ul);
+  std::atomic<size_t> n_reused_nodes = ATOMIC_VAR_INIT(0ul);
+
+  // Adaptive share depth (Configuration::max_share_depth > 0). Requests
+  // carry how many levels to ship, chosen per depth of the requested node
+  // from how deep walks went into the units received at that depth.
+  ShardedMap<Key, int> unit_share_depth; // live units, levels shipped
+  std::vector<int> share_depths; // by depth of the requested node; kept across iterations
+
+  // History prefetch (Configuration::history_prefetch). The keys walks
+  // fetched in one iteration are requested at the start of the next, each
+  // as soon as its placeholder exists. Prefetching pauses while too few of
+  // the predicted keys turn out to be needed. predicted only changes
+  // between iterations; pending is sharded since every reply checks it.
+  static constexpr double history_min_accuracy = 0.5;
+  CProxy_TreeCanopy<Data> tc_proxy;
+  std::unordered_set<Key> fetched;   // on demand, this iteration
+  std::vector<std::unordered_set<Key>> rank_fetched; // per rank, merged into fetched
+  std::unordered_set<Key> predicted; // fetched last iteration
+  ShardedMap<Key, bool> pending;     // predicted, placeholder not there yet
+  std::atomic<size_t> n_pending = ATOMIC_VAR_INIT(0ul);
+  bool history_active = true;
+  double history_accuracy = 1.; // needed / predicted
+  double history_coverage = 0.; // predicted and needed / needed
+
+  // Request aggregation (Configuration::request_batch_size). Requests for
+  // entirely remote nodes wait per owner until the batch is full or this
+  // PE runs out of more urgent work, and go out as one requestNodesBatch.
+  struct Outbox {
+    std::vector<Key> keys;
+    std::vector<int> share_depths;
+    int min_depth = std::numeric_limits<int>::max();
+  };
+  std::map<int, Outbox> outboxes;
+  bool flush_scheduled = false;
 
   CacheManager() { }
 
@@ -39,9 +125,20 @@ public:
 
   void initialize() {
     delete_at_end.resize(CkNumPes(), std::vector<Node<Data>*>(0, nullptr));
+    rank_prefetch_set.resize(CkNumPes());
+    rank_nodewide_data.resize(CkNumPes());
+    rank_fetched.resize(CkNumPes());
     num_buckets.store(0u);
   }
 
+  // Charm++ runs smaller priorities first. Shallow nodes unlock the most
+  // traversal work, so their requests and replies jump the queue.
+  static CkEntryOptions fetchOptions(int depth) {
+    CkEntryOptions opts;
+    opts.setPriority(depth);
+    return opts;
+  }
+
   void lockMaps() {
     if (this->isNodeGroup()) maps_lock.lock();
   }
@@ -55,81 +152,139 @@ public:
 
   // we can call this on a timer during the traversal to keep the footprint light
   void cleanupFinishedCachedNodes() {
-    auto should_delete_root = cfcnHelper(root, 0);
-    CkAssert(!should_delete_root); // we'll keep the path to internals alive
+    lockMaps();
+    evict(0, false);
+    unlockMaps();
   }
-private:
-  // goal: delete cached nodes we fetched but are finished using.
-  // when a bucket will not open a node (either its a leaf
-  // or open() returned false) we do node->finished++
-  // then we sum up all those finisheds for a path
-  // when the sum == num_buckets, we can delete all further nodes down that path
-  // we can also delete our parent if all our siblings are finished too
-  bool cfcnHelper(Node<Data>* node, size_t sum_num_buckets_finished) { // returns should_delete
-    if (!node->isCached()) return false;
-    sum_num_buckets_finished += node->num_buckets_finished.load();
-    if (sum_num_buckets_finished == num_buckets.load()) {
-      node->triggerFree();
-      return true;
-    }
-    else if (sum_num_buckets_finished < num_buckets.load()) {
-      bool deleted_all_children = true;
-      for (int i = 0; i < node->n_children; i++) {
-        auto child = node->getChild(i);
-        if (child) {
-          auto should_del = cfcnHelper(child, sum_num_buckets_finished);
-          if (should_del) {
-            delete child;
-            node->exchangeChild(i, nullptr);
-          }
-          else deleted_all_children = false;
-        }
-      }
-      return deleted_all_children;
-    }
+
+  size_t beginWalk() {
+    lockMaps();
+    walk_epochs.insert(epoch);
+    unlockMaps();
+    return epoch;
+  }
+
+  void endWalk(size_t start_epoch) {
+    lockMaps();
+    auto it = walk_epochs.find(start_epoch);
+    if (it != walk_epochs.end()) walk_epochs.erase(it);
+    reclaim();
+    unlockMaps();
   }
+
+  // The node with this key in the cached tree, or in an evicted unit that
+  // walks are still using
+  Node<Data>* findNode(Key key, bool* live = nullptr);
+
+private:
+  static size_t footprint(Node<Data>* node);
+  bool isFinished(Node<Data>* node);
+  bool hasPendingRequest(Node<Data>* node);
+  void trackUnit(Node<Data>* unit, bool live);
+  Retired* findRetired(Key key);
+  void evict(size_t target_bytes, bool evict_unfinished);
+  void evictUnit(Node<Data>* unit, bool retire);
+  void reclaim();
 public:
   void destroy(bool restore) {
+    if (restore && treespec.ckLocalBranch()->getConfiguration().persist_cache) snapshotUnits();
+    if (restore && treespec.ckLocalBranch()->getConfiguration().history_prefetch) rollHistory();
+    if (restore && treespec.ckLocalBranch()->getConfiguration().max_share_depth > 0) adaptShareDepths();
+    if (restore && this->thisIndex == 0 && treespec.ckLocalBranch()->getConfiguration().collect_stats) {
+      CkPrintf("[CacheManager 0] %zu duplicate replies dropped\n", n_duplicates.load());
+      if (treespec.ckLocalBranch()->getConfiguration().persist_cache) {
+        CkPrintf("[CacheManager 0] delta replies reused %zu of %zu nodes\n", n_reused_nodes.load(), n_delta_nodes.load());
+      }
+    }
+    n_duplicates = 0;
+    n_delta_nodes = n_reused_nodes = 0;
+    unit_digests.clear();
+    unit_share_depth.clear();
     local_tps.clear();
     leaf_lookup.clear();
     subtree_copy_started.clear();
     prefetch_set.clear();
+    nodewide_data = Data();
+    for (auto& keys : rank_prefetch_set) keys.clear();
+    for (auto& data : rank_nodewide_data) data = Data();
+    work_pool.clear();
+    units.clear();
+    unit_pos.clear();
+    live_bytes = 0;
+    walk_epochs.clear();
+    for (auto& unit : retired) {
+      unit.node->triggerFree();
+      Node<Data>::release(unit.node);
+    }
+    retired.clear();
+    retired_bytes = 0;
 
     for (auto& dae : delete_at_end) {
       for (auto to_delete : dae) {
-        delete to_delete;
+        Node<Data>::release(to_delete);
       }
       dae.resize(0);
     }
 
     if (root != nullptr) {
       root->triggerFree();
-      delete root;
+      Node<Data>::release(root);
       root = nullptr;
     }
 
+    outboxes.clear();
+    flush_scheduled = false;
+
     if (restore) initialize();
   }
 
   template <typename Visitor>
   void startPrefetch(DPHolder<Data>, CkCallback);
   void startParentPrefetch(DPHolder<Data>, CkCallback);
+  void startHistoryPrefetch();
+  void flushRequests();
   void prepPrefetch(Node<Data>*);
-  void requestNodes(std::pair<Key, int>);
-  void serviceRequest(Node<Data>*, int);
+  void mergePrefetch();
+  void requestNodes(std::pair<Key, int>, int);
+  void requestDelta(Key, int, int, std::vector<uint64_t>);
+  void requestNodesBatch(std::vector<Key>, std::vector<int>, int);
+  void serviceRequest(Node<Data>*, int, int share_depth = 0);
+  void fetch(Node<Data>*, CkEntryOptions&);
   void recvStarterPack(std::pair<Key, SpatialNode<Data>>* pack, int n, CkCallback);
   void addCache(MultiData<Data>);
+  void recvSubtreeMsg(SubtreeMsg*);
+  void addCacheDelta(Key, MultiData<Data>);
   void receiveSubtree(MultiData<Data>, PPHolder<Data>);
   void restoreData(std::pair<Key, SpatialNode<Data>>);
   void connect(Node<Data>*);
 
 private:
-  void makeMsgPerNode(int, std::vector<Node<Data>*>&, std::vector<Particle>&, Node<Data>*);
-  Node<Data>* addCacheHelper(Particle*, int, std::pair<Key, SpatialNode<Data>>*, int, int, int, bool);
+  void makeMsgPerNode(int, std::vector<Node<Data>*>&, std::vector<Particle>*, Node<Data>*);
+  void packUnit(Node<Data>*, int, std::vector<Node<Data>*>&, std::vector<uint64_t>&);
+  Key addUnit(MultiData<Data>&, int, int, int);
+  bool isDuplicate(Key);
+  void recordUnit(Node<Data>*, const std::pair<Key, SpatialNode<Data>>*, int, const uint64_t*);
+  void queueRequest(Node<Data>*);
+  void sendBatch(int, Outbox&);
+  Node<Data>* findOwned(Key);
+  static uint64_t digest(Key, const SpatialNode<Data>&, const Particle*);
+  void snapshotUnits();
+  void sendRequest(Node<Data>*, CkEntryOptions&);
+  void prefetchPending(Node<Data>*);
+  void requestPredicted(const std::vector<Node<Data>*>&);
+  static bool isPlaceholder(Node<Data>*);
+  bool wasVisited(Node<Data>*);
+  void rollHistory();
+  int shareDepthHint(int depth) const;
+  int clampShareDepth(int share_depth) const;
+  void measureUnit(Node<Data>*, int, int, int&, bool&);
+  void adaptShareDepths();
+  Node<Data>* addCacheHelper(Particle*, int, std::pair<Key, SpatialNode<Data>>*, int, int, int, bool, std::shared_ptr<void> particle_buffer = nullptr);
   void restoreDataHelper(std::pair<Key, SpatialNode<Data>>&, bool);
   void insertNode(Node<Data>*, bool, bool);
   void swapIn(Node<Data>*);
   void process(Key);
+  void process(const std::vector<Key>&);
   void connect(Node<Data>*, bool);
   void connect(Node<Data>*, const std::vector<Node<Data>*>&);
 };
@@ -137,30 +292,156 @@ private:
 template <typename Data>
 template <typename Visitor>
 void CacheManager<Data>::startPrefetch(DPHolder<Data> dp_holder, CkCallback cb) {
+  mergePrefetch();
   dp_holder.proxy.template prefetch<Visitor>(nodewide_data, this->thisIndex, cb);
 }
 
 template <typename Data>
 void CacheManager<Data>::startParentPrefetch(DPHolder<Data> dp_holder, CkCallback cb) {
+  mergePrefetch();
   std::vector<Key> request_list (prefetch_set.begin(), prefetch_set.end());
   dp_holder.proxy.request(request_list.data(), request_list.size(), this->thisIndex, cb);
 }
 
+template <typename Data>
+void CacheManager<Data>::startHistoryPrefetch() {
+  if (!history_active) return;
+  for (auto key : predicted) pending.insert(key, true);
+  n_pending += predicted.size();
+  std::vector<Node<Data>*> ready;
+  for (auto key : predicted) {
+    auto node = root->getDescendant(key);
+    if (node && node->key == key) ready.push_back(node);
+  }
+  requestPredicted(ready);
+}
+
+// Requests the predicted placeholders that the arrival of top uncovered
+template <typename Data>
+void CacheManager<Data>::prefetchPending(Node<Data>* top) {
+  if (!top || n_pending.load() == 0) return;
+  std::vector<Node<Data>*> frontier, nodes {top};
+  while (!nodes.empty()) {
+    auto node = nodes.back();
+    nodes.pop_back();
+    if (isPlaceholder(node)) frontier.push_back(node);
+    else if (node->type == Node<Data>::Type::CachedRemote || node->type == Node<Data>::Type::CachedBoundary) {
+      for (int i = 0; i < node->n_children; i++) {
+        if (node->getChild(i)) nodes.push_back(node->getChild(i));
+      }
+    }
+  }
+  requestPredicted(frontier);
+}
+
+// Sends the requests for whichever of nodes are pending, one message per
+// owner for the entirely remote ones
+template <typename Data>
+void CacheManager<Data>::requestPredicted(const std::vector<Node<Data>*>& nodes) {
+  std::map<int, std::vector<Key>> batches;
+  std::map<int, std::vector<int>> batch_share_depths;
+  std::map<int, int> batch_depth;
+  std::vector<Node<Data>*> singles;
+  for (auto node : nodes) {
+    if (!isPlaceholder(node) || !pending.erase(node->key)) continue;
+    n_pending--;
+    if (node->requested.exchange(true)) continue; // a walk got there first
+    if (node->type == Node<Data>::Type::RemoteAboveTPKey || stale_units.count(node->key)) {
+      singles.push_back(node);
+      continue;
+    }
+    batches[node->cm_index].push_back(node->key);
+    batch_share_depths[node->cm_index].push_back(shareDepthHint(node->depth));
+    auto depth = batch_depth.emplace(node->cm_index, node->depth).first;
+    depth->second = std::min(depth->second, node->depth);
+  }
+  for (auto node : singles) {
+    auto opts = fetchOptions(node->depth);
+    sendRequest(node, opts);
+  }
+  for (auto& batch : batches) {
+    auto opts = fetchOptions(batch_depth[batch.first]);
+    this->thisProxy[batch.first].requestNodesBatch(batch.second, batch_share_depths[batch.first], this->thisIndex, &opts);
+  }
+}
+
+template <typename Data>
+bool CacheManager<Data>::isPlaceholder(Node<Data>* node) {
+  return node->type == Node<Data>::Type::Remote
+    || node->type == Node<Data>::Type::RemoteLeaf
+    || node->type == Node<Data>::Type::RemoteAboveTPKey;
+}
+
+// Some bucket finished with node or a cached node under it
+template <typename Data>
+bool CacheManager<Data>::wasVisited(Node<Data>* node) {
+  if (node->num_buckets_finished.load() > 0) return true;
+  if (node->type != Node<Data>::Type::CachedRemote && node->type != Node<Data>::Type::CachedBoundary) return false;
+  for (int i = 0; i < node->n_children; i++) {
+    auto child = node->getChild(i);
+    if (child && wasVisited(child)) return true;
+  }
+  return false;
+}
+
+// Scores this iteration's prediction and makes this iteration's fetches the
+// next one. A predicted key was needed if a walk fetched it or visited the
+// prefetched copy. Called before the tree is freed.
+template <typename Data>
+void CacheManager<Data>::rollHistory() {
+  for (auto& keys : rank_fetched) {
+    fetched.insert(keys.begin(), keys.end());
+    keys.clear();
+  }
+  size_t n_needed = 0;
+  for (auto key : predicted) {
+    auto node = root ? root->getDescendant(key) : nullptr;
+    bool needed = fetched.count(key) || (node && node->key == key && !isPlaceholder(node) && wasVisited(node));
+    if (needed) {
+      n_needed++;
+      fetched.insert(key);
+    }
+  }
+  history_accuracy = predicted.empty() ? 1. : (double)n_needed / predicted.size();
+  history_coverage = fetched.empty() ? 0. : (double)n_needed / fetched.size();
+  history_active = history_accuracy >= history_min_accuracy;
+  if (this->thisIndex == 0 && treespec.ckLocalBranch()->getConfiguration().collect_stats) {
+    CkPrintf("[CacheManager 0] history prefetch: accuracy %.2f, coverage %.2f, %s next iteration\n",
+        history_accuracy, history_coverage, history_active ? "on" : "off");
+  }
+  predicted.swap(fetched);
+  fetched.clear();
+  pending.clear();
+  n_pending = 0;
+}
+
 template <typename Data>
 void CacheManager<Data>::prepPrefetch(Node<Data>* node) {
-  // THIS IS IN LOCK. make faster? TODO
-  nodewide_data += node->data;
+  // Each PE only touches its own rank's slot, so no lock is needed
+  auto& keys = rank_prefetch_set[CkMyRank()];
+  rank_nodewide_data[CkMyRank()] += node->data;
   Key curr_key = node->key;
   auto branch_factor = node->getBranchFactor();
   while (curr_key > 1) {
     curr_key /= branch_factor;
-    prefetch_set.insert(curr_key);
+    keys.insert(curr_key);
     for (int i = 0; i < branch_factor; i++) {
-      prefetch_set.insert(curr_key * branch_factor + i);
+      keys.insert(curr_key * branch_factor + i);
     }
   }
 }
 
+// Called once every Subtree has connected, before the prefetch is sent
+template <typename Data>
+void CacheManager<Data>::mergePrefetch() {
+  for (int rank = 0; rank < rank_prefetch_set.size(); rank++) {
+    prefetch_set.insert(rank_prefetch_set[rank].begin(), rank_prefetch_set[rank].end());
+    nodewide_data += rank_nodewide_data[rank];
+    rank_prefetch_set[rank].clear();
+    rank_nodewide_data[rank] = Data();
+  }
+}
+
 // Invoked to restore a node in the cached tree structure
 // or to store the local roots of Subtrees after the tree is built
 template <typename Data>
@@ -176,21 +457,17 @@ void CacheManager<Data>::connect(Node<Data>* node, bool should_process) {
 
 template <typename Data>
 void CacheManager<Data>::connect(Node<Data>* node) {
-  lockMaps();
   // Store/connect the incoming Subtree's local root
-  local_tps.insert(std::make_pair(node->key, node));
+  local_tps.insert(node->key, node);
   prepPrefetch(node);
-  unlockMaps();
   // XXX: May need to call process() for dual tree walk
 }
 
 template <typename Data>
 void CacheManager<Data>::connect(Node<Data>* node, const std::vector<Node<Data>*>& leaves) {
-  lockMaps();
   // Store/connect the incoming Subtree's local root
-  local_tps.insert(std::make_pair(node->key, node));
-  for (auto && leaf : leaves) leaf_lookup.emplace(leaf->key, leaf);
-  unlockMaps();
+  local_tps.insert(node->key, node);
+  for (auto && leaf : leaves) leaf_lookup.insert(leaf->key, leaf);
 }
 
 template <typename Data>
@@ -208,11 +485,11 @@ void CacheManager<Data>::recvStarterPack(std::pair<Key, SpatialNode<Data>>* pack
     // Restore received data as a tree node in the cache
     // XXX: Can the key ever be equal to a local TP?
     //      If not, the conditional is unnecessary
-    if (!local_tps.count(pack[i].first)) {
+    if (!local_tps.contains(pack[i].first)) {
       restoreDataHelper(pack[i], false);
     }
   }
-  if (n == 0) root = local_tps[1];
+  if (n == 0) local_tps.find(Key(1), root);
   CkAssert(root);
   this->contribute(cb);
 }
@@ -220,9 +497,9 @@ void CacheManager<Data>::recvStarterPack(std::pair<Key, SpatialNode<Data>>* pack
 template <typename Data>
 void CacheManager<Data>::receiveSubtree(MultiData<Data> multidata, PPHolder<Data> pp_holder) {
   addCacheHelper(multidata.particles.data(), multidata.particles.size(), multidata.nodes.data(), multidata.nodes.size(), multidata.cm_index, multidata.tp_index, true);
-  lockMaps();
-  auto copy_out = subtree_copy_started[multidata.tp_index];
-  unlockMaps();
+  // local_tps now has the copy; any Partition that registered before this
+  // missed it and is in copy_out (see Partition::receiveLeaves)
+  auto copy_out = subtree_copy_started.update(multidata.tp_index, [](std::vector<int>& out) {return out;});
   for (auto && partition : copy_out) {
     pp_holder.proxy[partition].makeLeaves(multidata.tp_index);
   }
@@ -230,19 +507,136 @@ void CacheManager<Data>::receiveSubtree(MultiData<Data> multidata, PPHolder<Data
 
 template <typename Data>
 void CacheManager<Data>::addCache(MultiData<Data> multidata) {
-  Node<Data>* top_node = addCacheHelper(multidata.particles.data(), multidata.particles.size(), multidata.nodes.data(), multidata.nodes.size(), multidata.cm_index, multidata.tp_index, false);
-  process(top_node->key);
+  process(addUnit(multidata, 0, multidata.nodes.size(), multidata.tp_index));
+}
+
+// Adds the subtree in nodes [first, end) of multidata to the cache, unless
+// it is already there; returns its key for the waiters either way
+template <typename Data>
+Key CacheManager<Data>::addUnit(MultiData<Data>& multidata, int first, int end, int tp_index) {
+  if (isDuplicate(multidata.nodes[first].first)) return multidata.nodes[first].first;
+  size_t p_index = 0;
+  for (int j = 0; j < first; j++) {
+    if (multidata.nodes[j].second.is_leaf) p_index += multidata.nodes[j].second.n_particles;
+  }
+  Node<Data>* top_node = addCacheHelper(multidata.particles.data() + p_index, multidata.particles.size() - p_index, multidata.nodes.data() + first, end - first, multidata.cm_index, tp_index, false);
+  recordUnit(top_node, multidata.nodes.data() + first, end - first, multidata.digests.empty() ? nullptr : multidata.digests.data() + first);
+  return top_node->key;
+}
+
+// Whether a reply for key finds the node already cached. Its waiters
+// resume on that copy, and the reply is dropped before it is unpacked so
+// that the unit's bookkeeping stays with the copy in the tree.
+template <typename Data>
+bool CacheManager<Data>::isDuplicate(Key key) {
+  auto node = findNode(key);
+  if (node->type != Node<Data>::Type::CachedRemote && node->type != Node<Data>::Type::CachedRemoteLeaf) return false;
+  n_duplicates++;
+  return true;
+}
+
+// Notes what arrived for a new unit, if anything reads it at the end of the
+// iteration, and prefetches below it
+template <typename Data>
+void CacheManager<Data>::recordUnit(Node<Data>* top_node, const std::pair<Key, SpatialNode<Data>>* nodes, int n_nodes, const uint64_t* digests) {
+  auto& config = treespec.ckLocalBranch()->getConfiguration();
+  if (config.persist_cache || config.max_share_depth > 0) {
+    const int top_depth = nodes[0].second.depth;
+    int max_depth = top_depth;
+    for (int j = 0; j < n_nodes; j++) max_depth = std::max(max_depth, nodes[j].second.depth);
+    unit_share_depth.update(top_node->key, [&](int& shipped) {shipped = max_depth - top_depth + 1;});
+  }
+  if (digests) {
+    unit_digests.update(top_node->key, [&](std::vector<uint64_t>& unit) {unit.assign(digests, digests + n_nodes);});
+  }
+  prefetchPending(top_node);
 }
 
+// The leaves of the new units keep msg alive and read its particles in
+// place. Every unit goes in before any waiter resumes.
 template <typename Data>
-Node<Data>* CacheManager<Data>::addCacheHelper(Particle* particles, int n_particles, std::pair<Key, SpatialNode<Data>>* nodes, int n_nodes, int cm_index, int tp_index, bool add_to_tps) {
+void CacheManager<Data>::recvSubtreeMsg(SubtreeMsg* msg) {
+  if (msg->n_roots == 1 && isDuplicate(msg->topKey())) {
+    process(msg->topKey());
+    CkFreeMsg(msg);
+    return;
+  }
+  auto nodes = msg->template unpackNodes<Data>();
+  auto buffer = msg->share();
+  std::vector<Key> keys;
+  size_t p_index = 0;
+  for (int i = 0; i < msg->n_roots; i++) {
+    const int first = msg->rootNode(i);
+    const int end = (i + 1 < msg->n_roots) ? msg->rootNode(i + 1) : nodes.size();
+    const size_t unit_p_index = p_index;
+    for (int j = first; j < end; j++) {
+      if (nodes[j].second.is_leaf) p_index += nodes[j].second.n_particles;
+    }
+    keys.push_back(nodes[first].first);
+    if (msg->n_roots > 1 && isDuplicate(nodes[first].first)) continue;
+    Node<Data>* top_node = addCacheHelper(msg->particles + unit_p_index, p_index - unit_p_index, nodes.data() + first, end - first, msg->cm_index, msg->rootTP(i), false, buffer);
+    recordUnit(top_node, nodes.data() + first, end - first, msg->n_digests ? msg->digests + first : nullptr);
+  }
+  process(keys);
+}
+
+// Rebuilds the full unit from the delta and the stale copy it was taken
+// against, then adds it like addCache
+template <typename Data>
+void CacheManager<Data>::addCacheDelta(Key key, MultiData<Data> delta) {
+  if (isDuplicate(key)) {
+    process(key);
+    return;
+  }
+  auto it = stale_units.find(key);
+  CkAssert(delta.reused.empty() || it != stale_units.end());
+  const MultiData<Data>* stale = (it == stale_units.end()) ? nullptr : &it->second;
+
+  MultiData<Data> full;
+  full.cm_index = delta.cm_index;
+  full.tp_index = delta.tp_index;
+  size_t stale_offset = 0, delta_offset = 0;
+  auto reused = delta.reused.begin();
+  auto fresh = delta.nodes.begin();
+  for (int i = 0; i < delta.digests.size(); i++) {
+    const bool reuse = reused != delta.reused.end() && *reused == i;
+    auto& node = reuse ? stale->nodes[i] : *fresh++;
+    const int n_leaf_particles = node.second.is_leaf ? node.second.n_particles : 0;
+    if (reuse) {
+      auto first = stale->particles.begin() + stale_offset;
+      full.particles.insert(full.particles.end(), first, first + n_leaf_particles);
+      reused++;
+    }
+    else {
+      auto first = delta.particles.begin() + delta_offset;
+      full.particles.insert(full.particles.end(), first, first + n_leaf_particles);
+      delta_offset += n_leaf_particles;
+    }
+    if (stale && i < stale->nodes.size() && stale->nodes[i].second.is_leaf) {
+      stale_offset += stale->nodes[i].second.n_particles;
+    }
+    full.nodes.push_back(node);
+  }
+  CkAssert(fresh == delta.nodes.end() && delta_offset == delta.particles.size());
+  n_delta_nodes += full.nodes.size();
+  n_reused_nodes += delta.reused.size();
+#if DEBUG
+  CkPrintf("[CM %d] delta for 0x%" PRIx64 " reuses %zu of %zu nodes\n", this->thisIndex, key, delta.reused.size(), full.nodes.size());
+#endif
+  full.digests = std::move(delta.digests);
+  addCache(std::move(full));
+}
+
+template <typename Data>
+Node<Data>* CacheManager<Data>::addCacheHelper(Particle* particles, int n_particles, std::pair<Key, SpatialNode<Data>>* nodes, int n_nodes, int cm_index, int tp_index, bool add_to_tps, std::shared_ptr<void> particle_buffer) {
 #if DEBUG
   CkPrintf("adding cache for top node 0x%" PRIx64 " on cm %d\n", nodes[0].first, this->thisIndex);
 #endif
 
   Node<Data>* first_node_placeholder_parent = nullptr;
+  bool live = true;
   if (!add_to_tps) {
-    auto first_node_placeholder = (!add_to_tps) ? root->getDescendant(nodes[0].first) : nullptr;
+    auto first_node_placeholder = findNode(nodes[0].first, &live);
     if (first_node_placeholder->type == Node<Data>::Type::CachedRemote
       || first_node_placeholder->type == Node<Data>::Type::CachedRemoteLeaf)
     {
@@ -251,76 +645,552 @@ Node<Data>* CacheManager<Data>::addCacheHelper(Particle* particles, int n_partic
     first_node_placeholder_parent = first_node_placeholder->parent;
   }
 
-  auto top_type = nodes[0].second.is_leaf ? Node<Data>::Type::CachedRemoteLeaf : Node<Data>::Type::CachedRemote;
-  auto first_node = treespec.ckLocalBranch()->template makeCachedNode<Data>(nodes[0].first, top_type, nodes[0].second, first_node_placeholder_parent, particles);
+  // The whole unit, with placeholders below its bottom level, goes into one
+  // arena. The message is depth first; the arena is laid out breadth first
+  // so that the levels a walk scans are adjacent in memory.
+  auto tree_spec = treespec.ckLocalBranch();
+  const Key branch_factor = tree_spec->getTree()->getBranchFactor();
+  std::vector<int> order (n_nodes);
+  std::vector<size_t> p_offsets (n_nodes);
+  size_t n_slots = 1;
+  size_t p_index = 0;
+  for (int j = 0; j < n_nodes; j++) {
+    order[j] = j;
+    p_offsets[j] = p_index;
+    if (nodes[j].second.is_leaf) p_index += nodes[j].second.n_particles;
+    else n_slots += branch_factor; // children from the message or placeholders
+  }
+  std::sort(order.begin(), order.end(), [&](int a, int b) {
+    return std::make_pair(nodes[a].second.depth, nodes[a].first) < std::make_pair(nodes[b].second.depth, nodes[b].first);
+  });
+  auto arena = new NodeArena<Data>(n_slots, tree_spec->template cachedNodeSize<Data>());
+
+  Node<Data>* first_node = nullptr;
   std::vector<Node<Data>*> leaves;
-  if (nodes[0].second.is_leaf) leaves.push_back(first_node);
-  first_node->cm_index = cm_index;
-  first_node->tp_index = tp_index;
-  insertNode(first_node, false, false);
-  auto branch_factor = first_node->getBranchFactor();
-  int p_index = nodes[0].second.is_leaf ? nodes[0].second.n_particles : 0;
-  for (int j = 1; j < n_nodes; j++) {
+  for (int j : order) {
     auto && new_key = nodes[j].first;
     auto && spatial_node = nodes[j].second;
-    auto curr_parent = first_node->getDescendant(new_key / branch_factor);
+    auto curr_parent = first_node ? first_node->getDescendant(new_key / branch_factor) : first_node_placeholder_parent;
     auto type = spatial_node.is_leaf ? Node<Data>::Type::CachedRemoteLeaf : Node<Data>::Type::CachedRemote;
-    auto node = treespec.ckLocalBranch()->template makeCachedNode<Data>(new_key, type, spatial_node, curr_parent, &particles[p_index]);
+    auto node = tree_spec->template makeCachedNode<Data>(new_key, type, spatial_node, curr_parent, particles + p_offsets[j], particle_buffer, arena->allocate());
+    arena->adopt(node);
     node->cm_index = cm_index;
     node->tp_index = tp_index;
-    if (node->is_leaf) {
-      p_index += spatial_node.n_particles;
-      leaves.push_back(node);
+    if (node->is_leaf) leaves.push_back(node);
+    if (first_node) curr_parent->exchangeChild(new_key % branch_factor, node);
+    else first_node = node;
+  }
+  const size_t n_made = arena->nodes.size();
+  for (size_t j = 0; j < n_made; j++) {
+    auto node = arena->nodes[j];
+    for (int i = 0; i < node->n_children; i++) {
+      if (node->getChild(i)) continue;
+      Data empty_data;
+      SpatialNode<Data> empty_sn (empty_data, 0, false, nullptr, node->depth + 1);
+      auto placeholder = tree_spec->template makeCachedNode<Data>(node->key * branch_factor + i, Node<Data>::Type::Remote, empty_sn, node, nullptr, nullptr, arena->allocate());
+      arena->adopt(placeholder);
+      placeholder->cm_index = node->cm_index;
+      node->exchangeChild(i, placeholder);
     }
-    insertNode(node, false, true);
   }
   if (add_to_tps) connect(first_node, leaves);
-  else swapIn(first_node);
+  else {
+    swapIn(first_node);
+    trackUnit(first_node, live);
+  }
   return first_node;
 }
 
 template <typename Data>
-void CacheManager<Data>::requestNodes(std::pair<Key, int> param) {
-  Key key = param.first;
+Node<Data>* CacheManager<Data>::findNode(Key key, bool* live) {
+  if (live) *live = true;
+  Node<Data>* node = root->getDescendant(key);
+  if (node && node->key == key) return node;
+  lockMaps();
+  auto unit = findRetired(key);
+  if (unit) node = unit->node->getDescendant(key);
+  unlockMaps();
+  if (!node || node->key != key) {
+    CkPrintf("CacheManager::findNode: node not found for key %lu on cm %d\n", key, this->thisIndex);
+    CkAbort("CacheManager::findNode: node not found");
+  }
+  if (live) *live = false;
+  return node;
+}
+
+// The evicted unit that key is in, if any. Called with maps locked.
+template <typename Data>
+typename CacheManager<Data>::Retired* CacheManager<Data>::findRetired(Key key) {
+  const Key branch_factor = root->getBranchFactor();
+  for (auto& unit : retired) {
+    Key ancestor = key;
+    while (ancestor > unit.node->key) ancestor /= branch_factor;
+    if (ancestor == unit.node->key) return &unit;
+  }
+  return nullptr;
+}
+
+template <typename Data>
+size_t CacheManager<Data>::footprint(Node<Data>* node) {
+  size_t bytes = sizeof(Node<Data>) + node->n_children * sizeof(Node<Data>*);
+  if (node->type == Node<Data>::Type::CachedRemoteLeaf) bytes += node->n_particles * sizeof(Particle);
+  if (node->type == Node<Data>::Type::CachedRemote) {
+    for (int i = 0; i < node->n_children; i++) {
+      auto child = node->getChild(i);
+      if (child) bytes += footprint(child);
+    }
+  }
+  return bytes;
+}
+
+// Every bucket on this node has finished with the node or an ancestor
+template <typename Data>
+bool CacheManager<Data>::isFinished(Node<Data>* node) {
+  size_t sum_num_buckets_finished = 0;
+  for (; node; node = node->parent) sum_num_buckets_finished += node->num_buckets_finished.load();
+  return sum_num_buckets_finished >= num_buckets.load();
+}
+
+// A placeholder below node has been requested and its reply is on the way
+template <typename Data>
+bool CacheManager<Data>::hasPendingRequest(Node<Data>* node) {
+  if (node->requested.load()) return true;
+  if (node->type != Node<Data>::Type::CachedRemote) return false;
+  for (int i = 0; i < node->n_children; i++) {
+    auto child = node->getChild(i);
+    if (child && hasPendingRequest(child)) return true;
+  }
+  return false;
+}
+
+template <typename Data>
+void CacheManager<Data>::trackUnit(Node<Data>* unit, bool live) {
+  auto& config = treespec.ckLocalBranch()->getConfiguration();
+  const size_t budget = (size_t)config.cache_budget_mb << 20;
+  // Nothing evicts or walks the units, so the hot path stays off maps_lock
+  if (budget == 0 && !config.persist_cache && config.max_share_depth <= 0) return;
+  // Only its own nodes and placeholders yet; later units replace those
+  const size_t bytes = footprint(unit);
+  lockMaps();
+  if (live) {
+    unit_pos[unit] = units.insert(units.end(), Unit{unit, bytes});
+    live_bytes += bytes;
+    // Evict down to 90% so that passes stay infrequent
+    if (budget > 0 && live_bytes > budget) evict(budget / 10 * 9, true);
+  }
+  else {
+    // Arrived under an evicted unit and goes when that one is reclaimed
+    auto enclosing = findRetired(unit->key);
+    if (enclosing) enclosing->bytes += bytes;
+    retired_bytes += bytes;
+  }
+  unlockMaps();
+}
+
+// Evicts fully finished units, then, if evict_unfinished, the least recently
+// fetched ones until live_bytes is at most target_bytes. Units with requests
+// in flight stay, and so does the newest, which has waiters about to resume.
+// Entries of units evicted with an enclosing one are dropped on the way.
+// Called with maps locked.
+template <typename Data>
+void CacheManager<Data>::evict(size_t target_bytes, bool evict_unfinished) {
+  if (live_bytes <= target_bytes || units.empty()) return;
+  const auto end = evict_unfinished ? std::prev(units.end()) : units.end();
+  for (auto it = units.begin(); it != end && live_bytes > target_bytes;) {
+    if (it->node && isFinished(it->node) && !hasPendingRequest(it->node)) evictUnit(it->node, false);
+    if (it->node) ++it;
+    else it = units.erase(it);
+  }
+  if (!evict_unfinished) return;
+  for (auto it = units.begin(); it != end && live_bytes > target_bytes;) {
+    if (it->node && !hasPendingRequest(it->node)) evictUnit(it->node, true);
+    if (it->node) ++it;
+    else it = units.erase(it);
+  }
+#if DEBUG
+  CkPrintf("[CM %d] cache at %zu bytes after eviction, %zu bytes retired\n", this->thisIndex, live_bytes, retired_bytes);
+#endif
+}
+
+// Swaps a placeholder in for unit and frees it, or retires it if walks may
+// still be inside. The units under it go too; their list entries are left
+// null for evict() to drop.
+template <typename Data>
+void CacheManager<Data>::evictUnit(Node<Data>* unit, bool retire) {
+  CkAssert(unit->parent);
+  size_t bytes = 0;
+  std::vector<Node<Data>*> nodes {unit};
+  while (!nodes.empty()) {
+    auto node = nodes.back();
+    nodes.pop_back();
+    auto it = unit_pos.find(node);
+    if (it != unit_pos.end()) {
+      bytes += it->second->bytes;
+      it->second->node = nullptr;
+      unit_pos.erase(it);
+    }
+    if (node->type != Node<Data>::Type::CachedRemote) continue;
+    for (int i = 0; i < node->n_children; i++) {
+      if (node->getChild(i)) nodes.push_back(node->getChild(i));
+    }
+  }
+  live_bytes -= std::min(bytes, live_bytes);
+  Data empty_data;
+  SpatialNode<Data> empty_sn (empty_data, 0, false, nullptr, unit->depth);
+  auto placeholder = treespec.ckLocalBranch()->makeCachedNode(unit->key, Node<Data>::Type::Remote, empty_sn, unit->parent, nullptr);
+  placeholder->cm_index = unit->cm_index;
+  placeholder->tp_index = unit->tp_index;
+  unit->parent->exchangeChild(unit->key % unit->getBranchFactor(), placeholder);
+  if (retire) {
+    retired.push_back(Retired{++epoch, unit, bytes});
+    retired_bytes += bytes;
+  }
+  else {
+    unit->triggerFree();
+    Node<Data>::release(unit);
+  }
+}
+
+// Deletes evicted units that no running walk started early enough to see.
+// Called with maps locked.
+template <typename Data>
+void CacheManager<Data>::reclaim() {
+  const size_t oldest = walk_epochs.empty() ? std::numeric_limits<size_t>::max() : *walk_epochs.begin();
+  auto keep = std::remove_if(retired.begin(), retired.end(), [&](const Retired& unit) {
+    if (unit.epoch > oldest) return false;
+    retired_bytes -= std::min(unit.bytes, retired_bytes);
+    unit.node->triggerFree();
+    Node<Data>::release(unit.node);
+    return true;
+  });
+  retired.erase(keep, retired.end());
+}
+
+template <typename Data>
+Node<Data>* CacheManager<Data>::findOwned(Key key) {
   Key temp = key;
-  while (!local_tps.count(temp)) temp /= root->getBranchFactor();
-  Node<Data>* node = local_tps[temp]->getDescendant(key);
+  Node<Data>* tp = nullptr;
+  while (!local_tps.find(temp, tp)) temp /= root->getBranchFactor();
+  Node<Data>* node = tp->getDescendant(key);
   if (!node) {
-    CkPrintf("CacheManager::requestNodes: node not found for key %lu on cm %d\n", param.first, this->thisIndex);
+    CkPrintf("CacheManager::requestNodes: node not found for key %lu on cm %d\n", key, this->thisIndex);
     CkAbort("CacheManager::requestNodes: node not found");
   }
-  serviceRequest(node, param.second);
+  return node;
+}
+
+template <typename Data>
+void CacheManager<Data>::requestNodes(std::pair<Key, int> param, int share_depth) {
+  serviceRequest(findOwned(param.first), param.second, share_depth);
+}
+
+// Answers several requests from one cache manager with a single reply
+template <typename Data>
+void CacheManager<Data>::requestNodesBatch(std::vector<Key> keys, std::vector<int> share_depths, int cm_index) {
+  if (cm_index == this->thisIndex) return; // you'll get it later!
+  std::vector<Node<Data>*> sending_nodes;
+  std::vector<uint64_t> digests;
+  std::vector<std::pair<int, int>> roots;
+  int min_depth = std::numeric_limits<int>::max();
+  for (int i = 0; i < keys.size(); i++) {
+    Node<Data>* node = findOwned(keys[i]);
+    roots.emplace_back(sending_nodes.size(), node->tp_index);
+    packUnit(node, share_depths[i], sending_nodes, digests);
+    min_depth = std::min(min_depth, node->depth);
+  }
+  this->thisProxy[cm_index].recvSubtreeMsg(SubtreeMsg::pack(sending_nodes, roots, digests, this->thisIndex, min_depth));
+}
+
+template <typename Data>
+void CacheManager<Data>::flushRequests() {
+  lockMaps();
+  std::map<int, Outbox> to_send;
+  to_send.swap(outboxes);
+  flush_scheduled = false;
+  unlockMaps();
+  for (auto& outbox : to_send) sendBatch(outbox.first, outbox.second);
+}
+
+// Buffers a request for an entirely remote node. The first one buffered
+// schedules a flush at the lowest priority, so a batch goes out once this
+// PE has nothing more urgent to run, e.g. when the walk that missed parks.
+template <typename Data>
+void CacheManager<Data>::queueRequest(Node<Data>* placeholder) {
+  const int batch_size = treespec.ckLocalBranch()->getConfiguration().request_batch_size;
+  Outbox full;
+  bool schedule = false;
+  lockMaps();
+  auto& outbox = outboxes[placeholder->cm_index];
+  outbox.keys.push_back(placeholder->key);
+  outbox.share_depths.push_back(shareDepthHint(placeholder->depth));
+  outbox.min_depth = std::min(outbox.min_depth, placeholder->depth);
+  if (outbox.keys.size() >= batch_size) {
+    std::swap(full, outbox);
+    outboxes.erase(placeholder->cm_index);
+  }
+  else if (!flush_scheduled) schedule = flush_scheduled = true;
+  unlockMaps();
+  if (!full.keys.empty()) sendBatch(placeholder->cm_index, full);
+  if (schedule) {
+    CkEntryOptions opts;
+    opts.setPriority(std::numeric_limits<int>::max());
+    this->thisProxy[this->thisIndex].flushRequests(&opts);
+  }
+}
+
+template <typename Data>
+void CacheManager<Data>::sendBatch(int cm_index, Outbox& outbox) {
+  auto opts = fetchOptions(outbox.min_depth);
+  if (outbox.keys.size() == 1) {
+    this->thisProxy[cm_index].requestNodes(std::make_pair(outbox.keys[0], this->thisIndex), outbox.share_depths[0], &opts);
+  }
+  else {
+    this->thisProxy[cm_index].requestNodesBatch(outbox.keys, outbox.share_depths, this->thisIndex, &opts);
+  }
 }
 
+// Like requestNodes, but the requester still holds a copy of the unit from
+// the last iteration; nodes whose digest matches are left out of the reply
 template <typename Data>
-void CacheManager<Data>::makeMsgPerNode(int start_depth, std::vector<Node<Data>*>& sending_nodes, std::vector<Particle>& sending_particles, Node<Data>* to_process)
+void CacheManager<Data>::requestDelta(Key key, int cm_index, int share_depth, std::vector<uint64_t> stale_digests) {
+  Node<Data>* node = findOwned(key);
+  std::vector<Node<Data>*> sending_nodes;
+  makeMsgPerNode(node->depth + clampShareDepth(share_depth), sending_nodes, nullptr, node);
+  MultiData<Data> delta;
+  delta.cm_index = this->thisIndex;
+  delta.tp_index = node->tp_index;
+  const bool comparable = stale_digests.size() == sending_nodes.size();
+  for (int i = 0; i < sending_nodes.size(); i++) {
+    auto sending = sending_nodes[i];
+    const Particle* particles = sending->type == Node<Data>::Type::Leaf ? sending->particles() : nullptr;
+    delta.digests.push_back(digest(sending->key, *sending, particles));
+    if (comparable && stale_digests[i] == delta.digests.back()) {
+      delta.reused.push_back(i);
+      continue;
+    }
+    SpatialNode<Data> copy = *sending;
+    delta.nodes.emplace_back(sending->key, copy);
+    if (particles) delta.particles.insert(delta.particles.end(), particles, particles + sending->n_particles);
+  }
+  auto opts = fetchOptions(node->depth);
+  this->thisProxy[cm_index].addCacheDelta(key, delta, &opts);
+}
+
+// Asks for the data behind a placeholder on behalf of a walk, which has
+// already claimed it through Node::requested
+template <typename Data>
+void CacheManager<Data>::fetch(Node<Data>* placeholder, CkEntryOptions& opts) {
+  // Each PE only touches its own rank's set, so no lock is needed
+  if (treespec.ckLocalBranch()->getConfiguration().history_prefetch) {
+    rank_fetched[CkMyRank()].insert(placeholder->key);
+  }
+  sendRequest(placeholder, opts);
+}
+
+template <typename Data>
+void CacheManager<Data>::sendRequest(Node<Data>* placeholder, CkEntryOptions& opts) {
+  if (placeholder->type == Node<Data>::Type::Boundary || placeholder->type == Node<Data>::Type::RemoteAboveTPKey) {
+    // Ask TreeCanopy for data
+    // If the canopy is at the same level as a TP, it asks the TP
+    // which eventually calls CacheManager::serviceRequest
+    // If the canopy is above TPs, it directly calls
+    // CacheManager::restoreData which fills in the cache
+    tc_proxy[placeholder->key].requestData(this->thisIndex, &opts);
+    return;
+  }
+  // The node is entirely remote, ask its owner, for a delta if the last
+  // iteration left a copy of it
+  std::vector<uint64_t> stale_digests;
+  if (!stale_units.empty()) {
+    auto it = stale_units.find(placeholder->key);
+    if (it != stale_units.end()) stale_digests = it->second.digests;
+  }
+  if (stale_digests.empty() && treespec.ckLocalBranch()->getConfiguration().request_batch_size > 1) {
+    queueRequest(placeholder);
+  }
+  else if (stale_digests.empty()) {
+    this->thisProxy[placeholder->cm_index].requestNodes(std::make_pair(placeholder->key, this->thisIndex), shareDepthHint(placeholder->depth), &opts);
+  }
+  else {
+    this->thisProxy[placeholder->cm_index].requestDelta(placeholder->key, this->thisIndex, shareDepthHint(placeholder->depth), stale_digests, &opts);
+  }
+}
+
+// FNV-1a over the node's key and moments and the position, mass and
+// softening of its particles: what a gravity walk reads. A reused leaf keeps
+// the other particle fields of the iteration it was first sent in.
+template <typename Data>
+uint64_t CacheManager<Data>::digest(Key key, const SpatialNode<Data>& node, const Particle* particles) {
+  uint64_t hash = 14695981039346656037ull;
+  auto add = [&hash](const void* data, size_t n) {
+    auto bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < n; i++) {
+      hash ^= bytes[i];
+      hash *= 1099511628211ull;
+    }
+  };
+  SpatialNode<Data> copy (node, nullptr);
+  PUP::sizer sizer;
+  sizer | copy;
+  std::vector<char> moments (sizer.size());
+  PUP::toMem packer (moments.data());
+  packer | copy;
+  add(&key, sizeof(key));
+  add(moments.data(), moments.size());
+  for (int i = 0; particles && i < node.n_particles; i++) {
+    add(&particles[i].position, sizeof(particles[i].position));
+    add(&particles[i].mass, sizeof(particles[i].mass));
+    add(&particles[i].soft, sizeof(particles[i].soft));
+  }
+  return hash;
+}
+
+// Keeps every live unit, in the depth-first order of makeMsgPerNode, for
+// the next iteration's delta requests. Called before the tree is freed.
+template <typename Data>
+void CacheManager<Data>::snapshotUnits() {
+  stale_units.clear();
+  for (auto& entry : units) {
+    auto unit = entry.node;
+    if (!unit) continue;
+    std::vector<uint64_t> digests;
+    if (!unit_digests.find(unit->key, digests)) continue;
+    int share_depth = 0;
+    unit_share_depth.find(unit->key, share_depth);
+    MultiData<Data> copy;
+    copy.cm_index = unit->cm_index;
+    copy.tp_index = unit->tp_index;
+    std::vector<Node<Data>*> stack {unit};
+    bool complete = true;
+    while (!stack.empty() && complete) {
+      auto node = stack.back();
+      stack.pop_back();
+      complete = node && (node->type == Node<Data>::Type::CachedRemote || node->type == Node<Data>::Type::CachedRemoteLeaf);
+      if (!complete) break;
+      copy.nodes.emplace_back(node->key, SpatialNode<Data>(*node, nullptr));
+      if (node->is_leaf) copy.particles.insert(copy.particles.end(), node->particles(), node->particles() + node->n_particles);
+      if (node->depth + 1 < unit->depth + share_depth) {
+        for (int i = node->n_children - 1; i >= 0; i--) stack.push_back(node->getChild(i));
+      }
+    }
+    if (!complete || copy.nodes.size() != digests.size()) continue;
+    copy.digests = std::move(digests);
+    stale_units.emplace(unit->key, std::move(copy));
+  }
+}
+
+// Collects to_process and its descendants shallower than end_depth
+template <typename Data>
+void CacheManager<Data>::makeMsgPerNode(int end_depth, std::vector<Node<Data>*>& sending_nodes, std::vector<Particle>* sending_particles, Node<Data>* to_process)
 {
-  auto config = treespec.ckLocalBranch()->getConfiguration();
   sending_nodes.push_back(to_process);
-  if (to_process->type == Node<Data>::Type::Leaf) {
-    std::copy(to_process->particles(), to_process->particles() + to_process->n_particles, std::back_inserter(sending_particles));
+  if (sending_particles && to_process->type == Node<Data>::Type::Leaf) {
+    std::copy(to_process->particles(), to_process->particles() + to_process->n_particles, std::back_inserter(*sending_particles));
   }
-  if (to_process->depth + 1 < start_depth + config.cache_share_depth) {
+  if (to_process->depth + 1 < end_depth) {
     for (int i = 0; i < to_process->n_children; i++) {
       Node<Data>* child = to_process->getChild(i);
-      makeMsgPerNode(start_depth, sending_nodes, sending_particles, child);
+      makeMsgPerNode(end_depth, sending_nodes, sending_particles, child);
     }
   }
 }
 
+// Levels to ship below a requested node: the requester's hint within the
+// configured bounds, or cache_share_depth without one
 template <typename Data>
-void CacheManager<Data>::serviceRequest(Node<Data>* node, int cm_index) {
+int CacheManager<Data>::clampShareDepth(int share_depth) const {
+  auto& config = treespec.ckLocalBranch()->getConfiguration();
+  if (share_depth <= 0 || config.max_share_depth <= 0) return config.cache_share_depth;
+  return std::max(std::max(config.min_share_depth, 1), std::min(share_depth, config.max_share_depth));
+}
+
+template <typename Data>
+int CacheManager<Data>::shareDepthHint(int depth) const {
+  return depth < share_depths.size() ? share_depths[depth] : 0;
+}
+
+// Levels of unit below node that walks reached (a bucket finished with a
+// node there), and whether any went past the shipped levels
+template <typename Data>
+void CacheManager<Data>::measureUnit(Node<Data>* node, int top_depth, int shipped, int& used, bool& deeper) {
+  if (node->depth >= top_depth + shipped) {
+    // Below the shipped levels: a walk asked for it or it came in separately
+    if (node->requested.load() || node->type != Node<Data>::Type::Remote) deeper = true;
+    return;
+  }
+  if (node->num_buckets_finished.load() > 0) used = std::max(used, node->depth - top_depth + 1);
+  if (node->type != Node<Data>::Type::CachedRemote) return;
+  for (int i = 0; i < node->n_children; i++) {
+    auto child = node->getChild(i);
+    if (child) measureUnit(child, top_depth, shipped, used, deeper);
+  }
+}
+
+// Picks next iteration's share depth for every depth that units were
+// requested at: one more level if most of them were walked past their
+// bottom, else the mean number of levels walks reached. Called before the
+// tree is freed.
+template <typename Data>
+void CacheManager<Data>::adaptShareDepths() {
+  struct Level {int n_units = 0, n_deeper = 0, sum_used = 0, sum_shipped = 0;};
+  std::map<int, Level> levels;
+  for (auto& entry : units) {
+    auto unit = entry.node;
+    if (!unit) continue;
+    int shipped = 0;
+    if (!unit_share_depth.find(unit->key, shipped)) continue;
+    int used = 0;
+    bool deeper = false;
+    measureUnit(unit, unit->depth, shipped, used, deeper);
+    auto& level = levels[unit->depth];
+    level.n_units++;
+    level.n_deeper += deeper;
+    level.sum_used += used;
+    level.sum_shipped += shipped;
+  }
+  for (auto& entry : levels) {
+    auto& level = entry.second;
+    int share_depth = (2 * level.n_deeper > level.n_units)
+      ? (level.sum_shipped + level.n_units / 2) / level.n_units + 1
+      : (level.sum_used + level.n_units - 1) / level.n_units;
+    if (entry.first >= share_depths.size()) share_depths.resize(entry.first + 1, 0);
+    share_depths[entry.first] = clampShareDepth(std::max(share_depth, 1));
+#if DEBUG
+    CkPrintf("[CM %d] share depth %d below depth %d (%d units, %d walked past)\n", this->thisIndex,
+        share_depths[entry.first], entry.first, level.n_units, level.n_deeper);
+#endif
+  }
+}
+
+// Appends node and the levels shipped below it to sending_nodes, and their
+// digests when the requester keeps units across iterations
+template <typename Data>
+void CacheManager<Data>::packUnit(Node<Data>* node, int share_depth, std::vector<Node<Data>*>& sending_nodes, std::vector<uint64_t>& digests) {
+  const size_t first = sending_nodes.size();
+  makeMsgPerNode(node->depth + clampShareDepth(share_depth), sending_nodes, nullptr, node);
+  if (treespec.ckLocalBranch()->getConfiguration().persist_cache) {
+    for (size_t i = first; i < sending_nodes.size(); i++) {
+      auto sending = sending_nodes[i];
+      const Particle* particles = sending->type == Node<Data>::Type::Leaf ? sending->particles() : nullptr;
+      digests.push_back(digest(sending->key, *sending, particles));
+    }
+  }
+}
+
+// Packed straight from the tree into a single buffer
+template <typename Data>
+void CacheManager<Data>::serviceRequest(Node<Data>* node, int cm_index, int share_depth) {
   if (cm_index == this->thisIndex) return; // you'll get it later!
   std::vector<Node<Data>*> sending_nodes;
-  std::vector<Particle> sending_particles;
-  makeMsgPerNode(node->depth, sending_nodes, sending_particles, node);
-  MultiData<Data> multidata (sending_particles.data(), sending_particles.size(), sending_nodes.data(), sending_nodes.size(), this->thisIndex, node->tp_index);
-  this->thisProxy[cm_index].addCache(multidata);
+  std::vector<uint64_t> digests;
+  packUnit(node, share_depth, sending_nodes, digests);
+  this->thisProxy[cm_index].recvSubtreeMsg(SubtreeMsg::pack(sending_nodes, {{0, node->tp_index}}, digests, this->thisIndex, node->depth));
 }
 
 template <typename Data>
 void CacheManager<Data>::restoreData(std::pair<Key, SpatialNode<Data>> param) {
   restoreDataHelper(param, true);
+  prefetchPending(root->getDescendant(param.first));
 }
 
 template <typename Data>
@@ -345,7 +1215,8 @@ void CacheManager<Data>::swapIn(Node<Data>* to_swap) {
   else {
     std::swap(root, to_swap);
   }
-  delete_at_end[CkMyRank()].push_back(to_swap);
+  // Placeholders in an arena go with the rest of it
+  if (to_swap && !to_swap->arena) delete_at_end[CkMyRank()].push_back(to_swap);
 }
 
 template <typename Data>
@@ -358,9 +1229,7 @@ void CacheManager<Data>::insertNode(Node<Data>* node, bool above_tp, bool should
     Key child_key = node->key * node->getBranchFactor() + i;
     bool add_placeholder = false;
     if (above_tp) {
-      auto it = local_tps.find(child_key);
-      if (it != local_tps.end()) {
-        new_child = it->second;
+      if (local_tps.find(child_key, new_child)) {
         new_child->parent = node;
       }
       else {
@@ -370,7 +1239,7 @@ void CacheManager<Data>::insertNode(Node<Data>* node, bool above_tp, bool should
     if (!above_tp || add_placeholder) {
       auto type = (above_tp) ? Node<Data>::Type::RemoteAboveTPKey : Node<Data>::Type::Remote;
       Data empty_data;
-      SpatialNode<Data> empty_sn (empty_data, 0, false, nullptr, 0);
+      SpatialNode<Data> empty_sn (empty_data, 0, false, nullptr, node->depth + 1);
       new_child = treespec.ckLocalBranch()->makeCachedNode(child_key, type, empty_sn, node, nullptr); // placeholder
       if (!above_tp) new_child->cm_index = node->cm_index;
     }
@@ -379,6 +1248,14 @@ void CacheManager<Data>::insertNode(Node<Data>* node, bool above_tp, bool should
   if (should_swap) swapIn(node);
 }
 
+template <typename Data>
+void CacheManager<Data>::process(const std::vector<Key>& keys) {
+  if (!this->isNodeGroup()) r_proxy[this->thisIndex].processKeys(keys);
+  else for (int i = 0; i < CkNodeSize(0); i++) {
+    r_proxy[this->thisIndex * CkNodeSize(0) + i].processKeys(keys);
+  }
+}
+
 template <typename Data>
 void CacheManager<Data>::process(Key key) {
   if (!this->isNodeGroup()) r_proxy[this->thisIndex].process (key);
@@ -12,6 +12,9 @@ struct CentroidData {
   Vector3D<Real> moment;
   Real sum_mass;
   Vector3D<Real> centroid; // too slow to compute this on the fly
+  // Reduced (traceless) quadrupole about the centroid,
+  // sum m (3 x_i x_j - |x|^2 delta_ij), as xx, xy, xz, yy, yz, zz
+  Real quadrupole[6];
   Real max_rad = 0.0;
   Real size_sm;
   std::vector< std::vector<pqSmoothNode> > neighbors; // Neighbor list for knn search
@@ -23,7 +26,7 @@ struct CentroidData {
   static constexpr const Real theta = 0.7;
 
   CentroidData() :
-  moment(Vector3D<Real> (0,0,0)), sum_mass(0), count(0), rsq(0.) {}
+  moment(Vector3D<Real> (0,0,0)), sum_mass(0), centroid(Vector3D<Real> (0,0,0)), quadrupole{}, count(0), rsq(0.) {}
 
   CentroidData(const Particle* particles, int n_particles) : CentroidData() {
     for (int i = 0; i < n_particles; i++) {
@@ -31,7 +34,10 @@ struct CentroidData {
       sum_mass += particles[i].mass;
       box.grow(particles[i].position);
     }
-    centroid = moment / sum_mass;
+    if (sum_mass > 0) centroid = moment / sum_mass;
+    for (int i = 0; i < n_particles; i++) {
+      addQuadrupole(particles[i].mass, particles[i].position - centroid);
+    }
     getRadius();
     count += n_particles;
     fixed_ball.resize(n_particles);
@@ -48,10 +54,30 @@ struct CentroidData {
     size_sm = 0.5*(box.size()).length();
   }
 
+  // Adds a point mass at offset d from the centroid to the quadrupole
+  void addQuadrupole(Real mass, const Vector3D<Real>& d) {
+    Real dsq = d.lengthSquared();
+    quadrupole[0] += mass * (3 * d.x * d.x - dsq);
+    quadrupole[1] += mass * 3 * d.x * d.y;
+    quadrupole[2] += mass * 3 * d.x * d.z;
+    quadrupole[3] += mass * (3 * d.y * d.y - dsq);
+    quadrupole[4] += mass * 3 * d.y * d.z;
+    quadrupole[5] += mass * (3 * d.z * d.z - dsq);
+  }
+
   const CentroidData& operator+=(const CentroidData& cd) { // needed for upward traversal
+    Real old_mass = sum_mass;
+    Vector3D<Real> old_centroid = centroid;
     moment += cd.moment;
     sum_mass += cd.sum_mass;
-    centroid = moment / sum_mass;
+    // Empty children leave the centroid, and so the quadrupole, alone
+    if (sum_mass > 0) centroid = moment / sum_mass;
+    // Both quadrupoles move to the combined centroid (parallel axis)
+    if (old_mass > 0) addQuadrupole(old_mass, old_centroid - centroid);
+    if (cd.sum_mass > 0) {
+      for (int i = 0; i < 6; i++) quadrupole[i] += cd.quadrupole[i];
+      addQuadrupole(cd.sum_mass, cd.centroid - centroid);
+    }
     box.grow(cd.box);
     getRadius();
     count += cd.count;
@@ -64,6 +90,7 @@ struct CentroidData {
     p | moment;
     p | sum_mass;
     p | centroid;
+    PUParray(p, quadrupole, 6);
     p | box;
     p | count;
     p | rsq;
@@ -35,10 +35,26 @@ namespace paratreet {
         int num_iterations;
         int num_share_nodes;
         int cache_share_depth;
+        int min_share_depth; // bounds of the per-request share depth; adaptive
+        int max_share_depth; // only if max_share_depth > 0
         int flush_period;
         int flush_max_avg_ratio;
         int lb_period;
         bool perturb_no_barrier;
+        bool collect_stats; // report traversal statistics every iteration
+        int stats_sample_period; // time one in this many visitor calls
+        int max_rung; // sub-steps per timestep are 2^max_rung (0: single stepping)
+        Real rung_eta; // accuracy parameter of the rung criterion
+        bool periodic; // periodic boundaries in the universe box of iteration 0
+        int cache_budget_mb; // evict cached remote subtrees beyond this (0: unlimited)
+        // Keep remote subtrees across iterations, refreshed by deltas. Nodes
+        // are compared by moments and particle position, mass and softening,
+        // so a particle that moved resends its leaf and all ancestors, and
+        // last iteration's copy is kept next to the live cache. Only pays off
+        // for data that barely moves between iterations; -x prints the reuse
+        bool persist_cache;
+        bool history_prefetch; // prefetch the remote nodes the last iteration fetched
+        int request_batch_size; // remote requests merged per owner (<= 1: sent one by one)
         std::string input_file;
         std::string output_file;
 #ifdef __CHARMC__
@@ -52,16 +68,65 @@ namespace paratreet {
             p | num_iterations;
             p | num_share_nodes;
             p | cache_share_depth;
+            p | min_share_depth;
+            p | max_share_depth;
             p | flush_period;
             p | flush_max_avg_ratio;
             p | lb_period;
             p | perturb_no_barrier;
+            p | collect_stats;
+            p | stats_sample_period;
+            p | max_rung;
+            p | rung_eta;
+            p | periodic;
+            p | cache_budget_mb;
+            p | persist_cache;
+            p | history_prefetch;
+            p | request_batch_size;
             p | input_file;
             p | output_file;
         }
 #endif //__CHARMC__
     };
 
+    // Per-traversal settings, passed to Partition::startDown
+    struct TraversalOptions {
+        // Record node and leaf interactions per bucket during the walk and
+        // evaluate them in one batched pass once the walk has finished
+        bool deferred = false;
+        // Carry active buckets as bitsets over the partition's buckets
+        // instead of index lists; cheaper when partitions have many buckets
+        bool bucket_bits = false;
+        // Split the walk into pieces of this many buckets that idle PEs in
+        // the same process may steal (0 disables; ignored when deferred)
+        int steal_chunk = 0;
+        // Give the PE back to the scheduler after visiting this many nodes
+        // so cache replies are serviced during long walks (0 disables)
+        int yield_after = 0;
+        // Test groups of buckets under local subtree nodes as single targets
+        // and split them only where their buckets disagree; needs a visitor
+        // whose open() cannot hold for a bucket but fail for its group.
+        // Ignored with bucket_bits and fused visitors
+        bool group_walk = false;
+        // Keep the interaction lists of a walk and replay them on the next
+        // steps without rebuilds while buckets and sources have moved less
+        // than half of replay_skin; walk again every replay_period steps
+        // (0 or 1 disables). Single visitors only
+        int replay_period = 0;
+        Real replay_skin = 0;
+#ifdef __CHARMC__
+        void pup(PUP::er &p) {
+            p | deferred;
+            p | bucket_bits;
+            p | steal_chunk;
+            p | yield_after;
+            p | group_walk;
+            p | replay_period;
+            p | replay_skin;
+        }
+#endif //__CHARMC__
+    };
+
     static std::string asString(TreeType t) {
       switch (t) {
         case TreeType::eOct:
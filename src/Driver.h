@@ -7,6 +7,7 @@
 #include <vector>
 
 #include <numeric>
+#include <queue>
 #include "Reader.h"
 #include "Splitter.h"
 #include "TreeCanopy.h"
@@ -43,6 +44,7 @@ public:
   std::vector<std::pair<Key, SpatialNode<Data>>> storage;
   bool storage_sorted;
   BoundingBox universe;
+  OrientedBox<Real> periodic_box; // universe.box of iteration 0, with config.periodic
   CProxy_Subtree<CentroidData> subtrees; // Cannot be a global readonly variable
   CProxy_Partition<CentroidData> partitions;
   int n_subtrees;
@@ -94,6 +96,12 @@ public:
     const Real fEps = 1.0 + 1.91e-6;  // slop to ensure keys fall between 0 and 1.
     bsize = Vector3D<Real>(fEps*0.5*max);
     universe.box = OrientedBox<Real>(bcenter-bsize, bcenter+bsize);
+    // The period is the first box; refitting it to the particles would
+    // change the period and the wrapping from step to step
+    if (config.periodic) {
+      if (iter == 0) periodic_box = universe.box;
+      else universe.box = periodic_box;
+    }
 
     std::cout << "Universal bounding box: " << universe << " with volume "
       << universe.box.volume() << std::endl;
@@ -175,8 +183,13 @@ public:
   // Core iterative loop of the simulation
   void run(CkCallback cb) {
     auto config = treespec.ckLocalBranch()->getConfiguration();
+    // With multiple time-stepping each iteration is one of 2^max_rung
+    // sub-steps of a base timestep chosen at its first sub-step
+    const int n_substeps = 1 << config.max_rung;
+    Real base_timestep = 0;
     for (int iter = 0; iter < config.num_iterations; iter++) {
       CkPrintf("\n* Iteration %d\n", iter);
+      const int substep = iter % n_substeps;
       double iter_time = CkWallTimer();
       // Start tree build in Subtrees
       start_time = CkWallTimer();
@@ -193,7 +206,8 @@ public:
       CkReduction::tupleElement* res = nullptr, *res2 = nullptr;
       msg->toTuple(&res, &numRedn);
       Real max_velocity = *(Real*)(res[0].data); // avoid max_velocity = 0.0
-      Real timestep_size = paratreet::getTimestep(universe, max_velocity);
+      if (substep == 0) base_timestep = paratreet::getTimestep(universe, max_velocity);
+      Real timestep_size = base_timestep / n_substeps;
 
       // Now track PE imbalance for memory reasons
       centroid_resumer.collectMetaData(CkCallbackResumeThread((void *&) msg2));
@@ -205,9 +219,13 @@ public:
       bool complete_rebuild = (config.flush_period == 0) ?
           (ratio > config.flush_max_avg_ratio) :
           (iter % config.flush_period == config.flush_period - 1) ;
+      // Decomposition only between base timesteps
+      complete_rebuild = complete_rebuild && substep == n_substeps - 1;
       CkPrintf("[Meta] n_subtree = %d; timestep_size = %f; sumPESize = %d; maxPESize = %d, avgPESize = %f; ratio = %f; maxVelocity = %f; rebuild = %s\n", n_subtrees, timestep_size, sumPESize, maxPESize, avgPESize, ratio, max_velocity, (complete_rebuild? "yes" : "no"));
       //End Subtree reduction message parsing
 
+      if (config.max_rung > 0) partitions.startSubstep(substep);
+
       // Prefetch into cache
       start_time = CkWallTimer();
       // use exactly one of these three commands to load the software cache
@@ -215,6 +233,8 @@ public:
       CkWaitQD();
       CkPrintf("TreeCanopy cache loading: %.3lf ms\n",
           (CkWallTimer() - start_time) * 1000);
+      // Overlaps with the traversal; both go through the same request flags
+      if (config.history_prefetch) centroid_cache.startHistoryPrefetch();
 
       // Perform traversals
       start_time = CkWallTimer();
@@ -224,6 +244,11 @@ public:
       }
       CkWaitQD();
       CkPrintf("Tree traversal: %.3lf ms\n", (CkWallTimer() - start_time) * 1000);
+      if (config.collect_stats) {
+        CkReductionMsg * part_msg;
+        partitions.collectStats(CkCallbackResumeThread((void *&) part_msg));
+        reportPartitionStats(part_msg, n_partitions);
+      }
 
       // Call user's post-interaction function, which may for example:
       // Output particle accelerations for verification
@@ -259,8 +284,10 @@ public:
 
       // Clear cache and other storages used in this iteration
       centroid_cache.destroy(true);
-      CkCallback statsCb (CkReductionTarget(Driver<Data>, countInts), this->thisProxy);
-      centroid_resumer.collectAndResetStats(statsCb);
+      CkReductionMsg * stats_msg;
+      centroid_resumer.collectAndResetStats(CkCallbackResumeThread((void *&) stats_msg));
+      if (config.collect_stats) reportStats(stats_msg);
+      delete stats_msg;
       storage.clear();
       storage_sorted = false;
       CkWaitQD();
@@ -277,8 +304,32 @@ public:
     CkPrintf("Tree build: %.3lf ms\n", (CkWallTimer() - start_time) * 1000);
   }
 
-  void countInts(unsigned long long* intrn_counts) {
-     CkPrintf("%llu node-particle interactions, %llu bucket-particle interactions %llu node opens, %llu node closes\n", intrn_counts[0], intrn_counts[1], intrn_counts[2], intrn_counts[3]);
+  void reportPartitionStats(CkReductionMsg* msg, int n_parts) {
+    int numRedn = 0;
+    CkReduction::tupleElement* res = nullptr;
+    msg->toTuple(&res, &numRedn);
+    double max_load = *(double*)(res[0].data);
+    double sum_load = *(double*)(res[1].data);
+    double avg_load = sum_load / std::max(n_parts, 1);
+    CkPrintf("[Stats] Partition visitor time: max %.3lf ms, avg %.3lf ms, ratio %.2f\n",
+        max_load * 1000, avg_load * 1000, avg_load > 0 ? max_load / avg_load : 0.);
+    delete [] res;
+    delete msg;
+  }
+
+  void reportStats(CkReductionMsg* msg) {
+    int numRedn = 0;
+    CkReduction::tupleElement* res = nullptr;
+    msg->toTuple(&res, &numRedn);
+    TraversalStats totals;
+    totals.unpack((unsigned long long*)(res[0].data), (double*)(res[1].data));
+    totals.max_wait = ((double*)(res[2].data))[0];
+    double max_pe_load = ((double*)(res[2].data))[1];
+    totals.print();
+    double avg_pe_load = totals.estimatedTime() / CkNumPes();
+    CkPrintf("[Stats] PE visitor time: max %.3lf ms, avg %.3lf ms, ratio %.2f\n",
+        max_pe_load * 1000, avg_pe_load * 1000, avg_pe_load > 0 ? max_pe_load / avg_pe_load : 0.);
+    delete [] res;
   }
 
   void recvTC(std::pair<Key, SpatialNode<Data>> param) {
@@ -310,39 +361,37 @@ public:
     storage_sorted = true;
   }
 
+  // Sends a cache manager the part of the canopy its walks will need: the
+  // root, and the children of every node that Visitor::cell() opens for the
+  // aggregate of the manager's local subtrees. Deeper canopy nodes are left
+  // as placeholders that are fetched on a miss. cell() must be free of side
+  // effects for this.
   template <typename Visitor>
-  void prefetch(Data nodewide_data, int cm_index, CkCallback cb) { // TODO
-    CkAssert(false);
-    // do traversal on the root, send everything
-    /*if (!storage_sorted) sortStorage();
-    std::queue<int> node_indices; // better for cache. plus no requirement here on order
-    node_indices.push(0);
-    std::vector<std::pair<Key, Data>> to_send;
-    Visitor v;
-    typename std::vector<std::pair<Key, Data> >::iterator it;
-
-    while (node_indices.size()) {
-      std::pair<Key, Data> node = storage[node_indices.front()];
+  void prefetch(Data nodewide_data, int cm_index, CkCallback cb) {
+    if (!storage_sorted) sortStorage();
+    std::vector<std::pair<Key, SpatialNode<Data>>> to_send;
+    SpatialNode<Data> local_tps (nodewide_data, 0, false, nullptr, 0);
+    const Key branch_factor = treespec.ckLocalBranch()->getTree()->getBranchFactor();
+    auto comp = [] (const std::pair<Key, SpatialNode<Data>>& a, const Key & b) {return a.first < b;};
+    // Breadth first, so that every node arrives after its parent
+    std::queue<int> node_indices;
+    if (!storage.empty() && storage[0].first == Key(1)) node_indices.push(0);
+    while (!node_indices.empty()) {
+      auto& node = storage[node_indices.front()];
       node_indices.pop();
       to_send.push_back(node);
-
-      Node<Data> dummy_node1, dummy_node2;
-      dummy_node1.data = node.second;
-      dummy_node2.data = nodewide_data;
-      if (v.cell(*dummy_node1, *dummy_node2)) {
-
-        for (int i = 0; i < BRANCH_FACTOR; i++) {
-          Key key = node.first * BRANCH_FACTOR + i;
-          auto comp = [] (auto && a, auto && b) {return a.first < b.first;};
-          it = std::lower_bound(storage.begin(), storage.end(), std::make_pair(key, Data()), comp);
-          if (it != storage.end() && it->first == key) {
-            node_indices.push(std::distance(storage.begin(), it));
-          }
+      if (node.second.is_leaf || !Visitor::cell(node.second, local_tps)) continue;
+      for (Key key = node.first * branch_factor; key < (node.first + 1) * branch_factor; key++) {
+        auto it = std::lower_bound(storage.begin(), storage.end(), key, comp);
+        if (it != storage.end() && it->first == key) {
+          node_indices.push(std::distance(storage.begin(), it));
         }
       }
     }
+#if DEBUG
+    CkPrintf("[Driver] prefetching %zu of %zu canopy nodes to cm %d\n", to_send.size(), storage.size(), cm_index);
+#endif
     cache_manager[cm_index].recvStarterPack(to_send.data(), to_send.size(), cb);
-    */
   }
 
   void request(Key* request_list, int list_size, int cm_index, CkCallback cb) {
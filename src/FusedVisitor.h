@@ -0,0 +1,57 @@
+#ifndef PARATREET_FUSEDVISITOR_H_
+#define PARATREET_FUSEDVISITOR_H_
+
+// Several visitors evaluated in a single down traversal, e.g.
+//   partitions.startDown<FusedVisitor<GravityVisitor, CollisionVisitor>>(opts);
+// The walk tracks (bucket, visitor) slots instead of buckets: a node is
+// opened if any visitor needs it for a bucket, and only the visitors that
+// opened it see its descendants. Remote nodes are fetched once for all.
+template <typename... Visitors>
+struct FusedVisitor {};
+
+namespace paratreet {
+
+template <int I, typename... Visitors>
+struct SlotDispatch;
+
+template <int I>
+struct SlotDispatch<I> {
+  static bool callSelfLeaf(int) {return false;}
+  template <typename S, typename T> static bool open(int, const S&, T&) {return false;}
+  template <typename S, typename T> static void node(int, const S&, T&) {}
+  template <typename S, typename T> static void leaf(int, const S&, T&) {}
+};
+
+template <int I, typename Visitor, typename... Rest>
+struct SlotDispatch<I, Visitor, Rest...> {
+  using Next = SlotDispatch<I + 1, Rest...>;
+  static bool callSelfLeaf(int v) {
+    return v == I ? Visitor::CallSelfLeaf : Next::callSelfLeaf(v);
+  }
+  template <typename S, typename T> static bool open(int v, const S& source, T& target) {
+    return v == I ? Visitor::open(source, target) : Next::open(v, source, target);
+  }
+  template <typename S, typename T> static void node(int v, const S& source, T& target) {
+    if (v == I) Visitor::node(source, target);
+    else Next::node(v, source, target);
+  }
+  template <typename S, typename T> static void leaf(int v, const S& source, T& target) {
+    if (v == I) Visitor::leaf(source, target);
+    else Next::leaf(v, source, target);
+  }
+};
+
+// Visitor calls by slot index; a plain visitor has a single slot
+template <typename Visitor>
+struct VisitorSlots : SlotDispatch<0, Visitor> {
+  static constexpr int size = 1;
+};
+
+template <typename... Visitors>
+struct VisitorSlots<FusedVisitor<Visitors...>> : SlotDispatch<0, Visitors...> {
+  static constexpr int size = sizeof...(Visitors);
+};
+
+} // namespace paratreet
+
+#endif // PARATREET_FUSEDVISITOR_H_
@@ -0,0 +1,154 @@
+#ifndef PARATREET_INTERACTIONLIST_H_
+#define PARATREET_INTERACTIONLIST_H_
+
+#include "Node.h"
+#include "KeyMap.h"
+#include "OrientedBox.h"
+#include <cmath>
+#include <vector>
+
+// Interactions recorded by a deferred traversal. Records are appended in
+// whatever order the walk produces them and then laid out per bucket in
+// compressed sparse row form by finalize(), so that evaluation touches one
+// target bucket at a time:
+//   sources[offsets[b], leaf_offsets[b])     node (M2P) interactions of b
+//   sources[leaf_offsets[b], offsets[b + 1]) leaf (P2P) interactions of b
+template <typename Data>
+class InteractionList {
+public:
+  void reset(int n_buckets) {
+    pending.clear();
+    sources.clear();
+    offsets.assign(n_buckets + 1, 0);
+    leaf_offsets.assign(n_buckets, 0);
+  }
+
+  void addNode(int bucket, Node<Data>* source) {
+    pending.push_back({source, bucket, false});
+  }
+
+  void addLeaf(int bucket, Node<Data>* source) {
+    pending.push_back({source, bucket, true});
+  }
+
+  bool hasPending() const {return !pending.empty();}
+  int numBuckets() const {return leaf_offsets.size();}
+
+  // Counting sort of the pending records into the CSR arrays
+  void finalize() {
+    const int n_buckets = numBuckets();
+    std::fill(offsets.begin(), offsets.end(), 0);
+    std::fill(leaf_offsets.begin(), leaf_offsets.end(), 0);
+    for (auto && record : pending) {
+      if (record.is_leaf) offsets[record.bucket + 1]++;
+      else leaf_offsets[record.bucket]++;
+    }
+    for (int b = 0; b < n_buckets; b++) {
+      int n_nodes = leaf_offsets[b];
+      leaf_offsets[b] = offsets[b] + n_nodes;
+      offsets[b + 1] += leaf_offsets[b];
+    }
+    cursor.assign(offsets.begin(), offsets.end() - 1);
+    leaf_cursor.assign(leaf_offsets.begin(), leaf_offsets.end());
+    sources.resize(pending.size());
+    for (auto && record : pending) {
+      int& pos = record.is_leaf ? leaf_cursor[record.bucket] : cursor[record.bucket];
+      sources[pos++] = record.source;
+    }
+    pending.clear();
+  }
+
+  Node<Data>* const* nodesBegin(int bucket) const {return sources.data() + offsets[bucket];}
+  Node<Data>* const* nodesEnd(int bucket)   const {return sources.data() + leaf_offsets[bucket];}
+  Node<Data>* const* leavesBegin(int bucket) const {return sources.data() + leaf_offsets[bucket];}
+  Node<Data>* const* leavesEnd(int bucket)   const {return sources.data() + offsets[bucket + 1];}
+
+private:
+  struct Record {
+    Node<Data>* source;
+    int bucket;
+    bool is_leaf;
+  };
+  std::vector<Record> pending;
+  std::vector<Node<Data>*> sources;
+  std::vector<int> offsets;
+  std::vector<int> leaf_offsets;
+  std::vector<int> cursor, leaf_cursor;
+};
+
+// The lists of a recorded walk by source key, kept across iterations for
+// ReplayTraverser. Same layout as InteractionList, plus the geometry that the
+// replay validity check compares against.
+struct SavedInteractions {
+  // A node source as it was recorded: its box, and the centroid and radius
+  // (sqrt of rsq) that centroid opening criteria test against
+  struct Source {
+    OrientedBox<Real> box;
+    Vector3D<Real> centroid;
+    Real radius;
+    int n_particles;
+  };
+
+  std::vector<Key> bucket_keys;
+  std::vector<OrientedBox<Real>> bucket_boxes;
+  std::vector<Key> sources;
+  std::vector<int> offsets, leaf_offsets;
+  KeyMap<Source> node_sources;
+  Real skin = 0;
+  int age = 0; // replays since the recording walk
+
+  // Call on a finalized list, before it is evaluated
+  template <typename Data>
+  void save(const InteractionList<Data>& list, const std::vector<Node<Data>*>& leaves, Real skini) {
+    clear();
+    skin = skini;
+    for (int b = 0; b < list.numBuckets(); b++) {
+      bucket_keys.push_back(leaves[b]->key);
+      bucket_boxes.push_back(leaves[b]->data.box);
+      offsets.push_back(sources.size());
+      for (auto it = list.nodesBegin(b); it != list.nodesEnd(b); ++it) {
+        auto& data = (*it)->data;
+        sources.push_back((*it)->key);
+        node_sources[(*it)->key] = Source{data.box, data.centroid, std::sqrt(data.rsq), (*it)->n_particles};
+      }
+      leaf_offsets.push_back(sources.size());
+      for (auto it = list.leavesBegin(b); it != list.leavesEnd(b); ++it) sources.push_back((*it)->key);
+    }
+    offsets.push_back(sources.size());
+  }
+
+  void clear() {
+    bucket_keys.clear();
+    bucket_boxes.clear();
+    sources.clear();
+    offsets.clear();
+    leaf_offsets.clear();
+    node_sources.clear();
+    age = 0;
+  }
+
+  bool empty() const {return bucket_keys.empty();}
+
+  // Whether box has left its recorded extent grown by half the skin
+  bool moved(const OrientedBox<Real>& recorded, const OrientedBox<Real>& box) const {
+    Vector3D<Real> slack(skin / 2);
+    auto lo = recorded.lesser_corner - slack, hi = recorded.greater_corner + slack;
+    return box.lesser_corner.x < lo.x || box.lesser_corner.y < lo.y || box.lesser_corner.z < lo.z
+        || box.greater_corner.x > hi.x || box.greater_corner.y > hi.y || box.greater_corner.z > hi.z;
+  }
+
+  // Whether a node source may now be opened for a bucket it was not opened
+  // for. The recording walk grew the buckets by the whole skin and the
+  // buckets may since have moved by half of it, which leaves the other half
+  // for the centroid's drift plus the growth of its radius.
+  template <typename Data>
+  bool moved(const Source& recorded, const Node<Data>* node) const {
+    const auto& data = node->data;
+    const Real drift = (data.centroid - recorded.centroid).length();
+    return node->n_particles != recorded.n_particles
+        || drift + std::sqrt(data.rsq) - recorded.radius > skin / 2
+        || moved(recorded.box, data.box);
+  }
+};
+
+#endif // PARATREET_INTERACTIONLIST_H_
@@ -0,0 +1,193 @@
+#ifndef PARATREET_KEYMAP_H_
+#define PARATREET_KEYMAP_H_
+
+#include "common.h"
+#include <cstring>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Vector that keeps up to N elements inline and only allocates beyond that.
+// Restricted to trivially copyable elements (bucket indices, partition
+// indices, node pointers, bucket sets).
+template <typename T, int N>
+class SmallVector {
+  static_assert(std::is_trivially_copyable<T>::value, "SmallVector only holds trivially copyable types");
+
+public:
+  SmallVector() = default;
+  SmallVector(const SmallVector& other) {*this = other;}
+  SmallVector(SmallVector&& other) {*this = std::move(other);}
+  ~SmallVector() {if (heap) delete [] heap;}
+
+  SmallVector& operator=(const SmallVector& other) {
+    if (this == &other) return *this;
+    n = 0;
+    reserve(other.n);
+    std::memcpy(data(), other.data(), other.n * sizeof(T));
+    n = other.n;
+    return *this;
+  }
+
+  SmallVector& operator=(SmallVector&& other) {
+    if (this == &other) return *this;
+    if (other.heap) {
+      if (heap) delete [] heap;
+      heap = other.heap;
+      cap = other.cap;
+      n = other.n;
+      other.heap = nullptr;
+      other.cap = N;
+      other.n = 0;
+    }
+    else {
+      *this = static_cast<const SmallVector&>(other);
+      other.n = 0;
+    }
+    return *this;
+  }
+
+  void push_back(const T& t) {
+    if (n == cap) reserve(2 * cap);
+    data()[n++] = t;
+  }
+
+  void reserve(int new_cap) {
+    if (new_cap <= cap) return;
+    T* grown = new T [new_cap];
+    std::memcpy(grown, data(), n * sizeof(T));
+    if (heap) delete [] heap;
+    heap = grown;
+    cap = new_cap;
+  }
+
+  void clear() {n = 0;}
+  int size() const {return n;}
+  bool empty() const {return n == 0;}
+  T* data() {return heap ? heap : reinterpret_cast<T*>(local);}
+  const T* data() const {return heap ? heap : reinterpret_cast<const T*>(local);}
+  T& operator[](int i) {return data()[i];}
+  const T& operator[](int i) const {return data()[i];}
+  T& back() {return data()[n - 1];}
+  T* begin() {return data();}
+  T* end() {return data() + n;}
+  const T* begin() const {return data();}
+  const T* end() const {return data() + n;}
+
+private:
+  typename std::aligned_storage<sizeof(T), alignof(T)>::type local[N];
+  T* heap = nullptr;
+  int n = 0;
+  int cap = N;
+};
+
+// Open-addressing hash table from Key to V with linear probing and
+// backward-shift deletion, for the key -> waiters tables hit on every remote
+// miss and resume. Keys and values sit in flat arrays; Key 0 is never a valid
+// node key and marks empty slots. Pointers returned by find() and operator[]
+// are invalidated by any insertion or erase, so move a value out before
+// erasing it. Each table belongs to a single PE (Resumer branch or
+// Partition), which keeps it safe under the nodegroup cache as well; it does
+// no locking of its own.
+template <typename V>
+class KeyMap {
+public:
+  explicit KeyMap(size_t initial_capacity = 64) {
+    size_t cap = 1;
+    while (cap < initial_capacity) cap <<= 1;
+    keys.assign(cap, empty_key);
+    values.resize(cap);
+  }
+
+  V& operator[](Key key) {
+    if (2 * (n + 1) > keys.size()) grow();
+    size_t i = home(key);
+    while (keys[i] != empty_key) {
+      if (keys[i] == key) return values[i];
+      i = (i + 1) & mask();
+    }
+    keys[i] = key;
+    n++;
+    return values[i];
+  }
+
+  V* find(Key key) {
+    size_t i = home(key);
+    while (keys[i] != empty_key) {
+      if (keys[i] == key) return &values[i];
+      i = (i + 1) & mask();
+    }
+    return nullptr;
+  }
+
+  bool erase(Key key) {
+    size_t i = home(key);
+    while (keys[i] != key) {
+      if (keys[i] == empty_key) return false;
+      i = (i + 1) & mask();
+    }
+    // Pull back later entries of the probe run that may now sit in slot i
+    size_t j = i;
+    while (true) {
+      j = (j + 1) & mask();
+      if (keys[j] == empty_key) break;
+      size_t k = home(keys[j]);
+      bool stays = (i < j) ? (i < k && k <= j) : (i < k || k <= j);
+      if (!stays) {
+        keys[i] = keys[j];
+        values[i] = std::move(values[j]);
+        i = j;
+      }
+    }
+    keys[i] = empty_key;
+    values[i] = V();
+    n--;
+    return true;
+  }
+
+  // Empties the table but keeps its capacity for the next iteration
+  void clear() {
+    if (n == 0) return;
+    for (size_t i = 0; i < keys.size(); i++) {
+      if (keys[i] != empty_key) {
+        keys[i] = empty_key;
+        values[i] = V();
+      }
+    }
+    n = 0;
+  }
+
+  size_t size() const {return n;}
+  bool empty() const {return n == 0;}
+
+private:
+  static constexpr Key empty_key = Key(0);
+
+  size_t mask() const {return keys.size() - 1;}
+
+  // Fibonacci hashing spreads the structured SFC bits over the table
+  size_t home(Key key) const {
+    return (size_t)((uint64_t(key) * 0x9E3779B97F4A7C15ull) >> 32) & mask();
+  }
+
+  void grow() {
+    std::vector<Key> old_keys(2 * keys.size(), empty_key);
+    std::vector<V> old_values(2 * keys.size());
+    old_keys.swap(keys);
+    old_values.swap(values);
+    n = 0;
+    for (size_t i = 0; i < old_keys.size(); i++) {
+      if (old_keys[i] != empty_key) (*this)[old_keys[i]] = std::move(old_values[i]);
+    }
+  }
+
+  std::vector<Key> keys;
+  std::vector<V> values;
+  size_t n = 0;
+};
+
+template <typename V>
+constexpr Key KeyMap<V>::empty_key;
+
+#endif // PARATREET_KEYMAP_H_
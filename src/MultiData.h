@@ -15,6 +15,11 @@ struct MultiData {
   std::vector<std::pair<Key, SpatialNode<Data>>> nodes;
   int cm_index = -1;
   int tp_index = -1;
+  // With Configuration::persist_cache: a digest per node, and for a delta
+  // reply the nodes (in depth-first order) that the requester takes from
+  // its copy of the previous iteration instead of from this message
+  std::vector<uint64_t> digests;
+  std::vector<int> reused;
 
   MultiData();
   MultiData(Particle*, int, Node<Data>**, int, int, int);
@@ -42,12 +47,16 @@ void MultiData<Data>::pup(PUP::er& p) {
   p | nodes;
   p | cm_index;
   p | tp_index;
+  p | digests;
+  p | reused;
 }
 
 template <typename Data>
 void MultiData<Data>::clear() {
   nodes.clear();
   particles.clear();
+  digests.clear();
+  reused.clear();
 }
 
 #endif // PARATREET_MULTIDATA_H_
@@ -4,6 +4,9 @@
 #include "Particle.h"
 #include <array>
 #include <atomic>
+#include <cstddef>
+#include <memory>
+#include <vector>
 
 template <typename Data>
 class SpatialNode
@@ -23,8 +26,9 @@ public:
   void changeParticle(int index, Particle& part) {
     particles_[index] = part;
   }
+  // Inactive particles keep the acceleration of their last full step
   void applyAcceleration(int index, Vector3D<Real> accel) {
-    particles_[index].acceleration += accel;
+    if (particles_[index].isActive()) particles_[index].acceleration += accel;
   }
   void applyGasWork(int index, Real work) {
     particles_[index].pressure_dVolume += work;
@@ -58,6 +62,9 @@ private:
 
 };
 
+template <typename Data>
+struct NodeArena;
+
 template <typename Data>
 class Node : public SpatialNode<Data>
 {
@@ -107,7 +114,7 @@ public:
   }
 
   virtual ~Node() {
-    if (type == Type::CachedRemoteLeaf) {
+    if (type == Type::CachedRemoteLeaf && !particle_buffer) {
       this->freeParticles();
     }
   }
@@ -126,6 +133,8 @@ public:
   int cm_index       = -1;
   std::atomic<bool> requested = ATOMIC_VAR_INIT(false);
   std::atomic<size_t> num_buckets_finished = ATOMIC_VAR_INIT(0);
+  std::shared_ptr<void> particle_buffer; // owns the particles if they are not this node's
+  NodeArena<Data>* arena = nullptr; // owns this node's memory if set
 
 public:
   Node<Data>* getDescendant(Key to_find) {
@@ -162,12 +171,19 @@ public:
         auto child = getChild(i);
         if (child == nullptr) continue;
         child->triggerFree();
-        delete child;
+        release(child);
 	    exchangeChild(i, nullptr);
       }
     }
   }
 
+  // Frees a node taken out of the tree. Nodes in an arena all go at once,
+  // together with the node the arena was built for.
+  static void release(Node* node) {
+    if (!node->arena) delete node;
+    else if (node->arena->top() == node) delete node->arena;
+  }
+
   static std::string TypeDotColor(Type type){
     switch(type){
       case Type::Invalid:               return "firebrick1";
@@ -209,6 +225,38 @@ public:
   }
 };
 
+// A single allocation holding the nodes of one cached subtree, in the order
+// they are constructed (breadth first, see CacheManager::addCacheHelper).
+// Deleting it destroys every node in it.
+template <typename Data>
+struct NodeArena {
+  NodeArena(size_t n_slotsi, size_t node_size)
+    : slot_size((node_size + alignof(std::max_align_t) - 1) / alignof(std::max_align_t) * alignof(std::max_align_t)),
+      n_slots(n_slotsi), block(new char[n_slotsi * slot_size])
+  {
+    nodes.reserve(n_slots);
+  }
+  ~NodeArena() {
+    for (auto node : nodes) node->~Node<Data>();
+  }
+
+  void* allocate() {
+    CkAssert(n_used < n_slots);
+    return block.get() + slot_size * n_used++;
+  }
+  void adopt(Node<Data>* node) {
+    node->arena = this;
+    nodes.push_back(node);
+  }
+  Node<Data>* top() const {return nodes.front();}
+
+  const size_t slot_size;
+  const size_t n_slots;
+  size_t n_used = 0;
+  std::unique_ptr<char[]> block;
+  std::vector<Node<Data>*> nodes;
+};
+
 template <class Data, size_t BRANCH_FACTOR>
 class FullNode : public Node<Data>
 {
@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "BoundingBox.h"
+#include <atomic>
 
 struct Particle {
   Key key;
@@ -21,6 +22,7 @@ struct Particle {
   Vector3D<Real> velocity_predicted;
   Real pressure_dVolume = 0.;
   Real potential_predicted;
+  int rung = 0; // steps by the base timestep / 2^rung
 
   Particle();
 
@@ -32,6 +34,74 @@ struct Particle {
   void perturb (Real timestep, OrientedBox<Real> universe) {
     position += (velocity * timestep);
     position += (acceleration * timestep * timestep / 2);
+    wrap(universe);
+    velocity += (acceleration * timestep);
+    velocity_predicted = velocity + (acceleration * timestep);
+    Real uDelta = 0.5e-7 * timestep;
+    potential -= pressure_dVolume * uDelta; // for adiabatic, dU = -p dV
+    potential_predicted = potential - pressure_dVolume * uDelta;
+    updateKey(universe);
+  }
+
+  // Multiple time-stepping: a particle is kicked by its own step when its
+  // rung is active and drifted on every sub-step
+  void kick(Real timestep) {
+    velocity += (acceleration * timestep);
+    deltaT = timestep;
+  }
+
+  void drift(Real timestep, OrientedBox<Real> universe) {
+    position += (velocity * timestep);
+    wrap(universe);
+    velocity_predicted = velocity;
+    updateKey(universe);
+  }
+
+  // Rung for the next step from the acceleration criterion
+  // dt = eta * sqrt(soft / |a|). Moving to a longer step is only possible
+  // at sub-steps that are also boundaries of that step.
+  int chooseRung(Real substep_size, int substep, int max_rung, Real eta) const {
+    Real accel = acceleration.length();
+    int new_rung = 0;
+    if (accel > 0 && soft > 0) {
+      Real dt = eta * std::sqrt(soft / accel);
+      Real step = substep_size * (1 << max_rung);
+      while (new_rung < max_rung && step > dt) {
+        step /= 2;
+        new_rung++;
+      }
+    }
+    while (new_rung < rung && substep % (1 << (max_rung - new_rung)) != 0) new_rung++;
+    return new_rung;
+  }
+
+  // Lowest rung whose particles are kicked at this sub-step
+  static int activeRung(int substep, int max_rung) {
+    int rung = max_rung;
+    while (rung > 0 && substep % (1 << (max_rung - rung + 1)) == 0) rung--;
+    return rung;
+  }
+
+  // Active rung of the sub-step being computed in this process, set by
+  // Partition::startSubstep; 0 (everything active) without sub-stepping
+  static std::atomic<int>& currentActiveRung() {
+    static std::atomic<int> rung(0);
+    return rung;
+  }
+
+  // Only active particles take forces on a sub-step
+  bool isActive() const {
+    return rung >= currentActiveRung().load(std::memory_order_relaxed);
+  }
+
+  bool operator==(const Particle&) const;
+  bool operator<=(const Particle&) const;
+  bool operator>(const Particle&) const;
+  bool operator>=(const Particle&) const;
+  bool operator<(const Particle&) const;
+
+private:
+  void wrap(const OrientedBox<Real>& universe) {
     for (int dim = 0; dim < 3; dim++) {
       CkAssert(std::isfinite(position[dim]));
       while (position[dim] < universe.lesser_corner[dim]) {
@@ -41,22 +111,14 @@ struct Particle {
         position[dim] -= universe.greater_corner[dim] - universe.lesser_corner[dim];
       }
     }
-    velocity += (acceleration * timestep);
-    velocity_predicted = velocity + (acceleration * timestep);
-    Real uDelta = 0.5e-7 * timestep;
-    potential -= pressure_dVolume * uDelta; // for adiabatic, dU = -p dV
-    potential_predicted = potential - pressure_dVolume * uDelta;
+  }
+
+  void updateKey(const OrientedBox<Real>& universe) {
     key = SFC::generateKey(position, universe);
     key |= (Key)1 << (KEY_BITS-1); // Add placeholder bit
     density = 0;
     pressure_dVolume = 0.;
   }
-
-  bool operator==(const Particle&) const;
-  bool operator<=(const Particle&) const;
-  bool operator>(const Particle&) const;
-  bool operator>=(const Particle&) const;
-  bool operator<(const Particle&) const;
 };
 
 #endif // PARATREET_PARTICLE_H_
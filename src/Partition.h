@@ -7,6 +7,9 @@
 #include "Traverser.h"
 #include "ParticleMsg.h"
 #include "MultiData.h"
+#include "InteractionList.h"
+#include "BucketSet.h"
+#include "TraversalStats.h"
 #include "paratreet.decl.h"
 
 extern CProxy_TreeSpec treespec;
@@ -21,14 +24,27 @@ struct Partition : public CBase_Partition<Data> {
   std::mutex receive_lock;
   std::vector<Node<Data>*> leaves;
   std::vector<Node<Data>*> tree_leaves;
+  // buckets the current traversal computes interactions for: all leaves,
+  // or on sub-steps of multiple time-stepping those with active particles
+  std::vector<Node<Data>*> targets;
+  int substep = 0;
 
   std::unique_ptr<Traverser<Data>> traverser;
   int n_partitions;
 
   std::map<int, std::vector<Key>> lookup_leaf_keys;
 
-  // filled in during traversal
-  std::vector<std::vector<Node<Data>*>> interactions;
+  // filled in during deferred traversals
+  InteractionList<Data> interactions;
+  // active bucket sets of the down traversal, one per set representation
+  TraversalArenas<BucketList::Word> bucket_arenas;
+  TraversalArenas<BucketBits::Word> bucket_bit_arenas;
+  // this Partition's share of the iteration's traversal work
+  TraversalStats stats;
+  // lists of the last recording walk, replayed while still valid
+  SavedInteractions saved_interactions;
+  // copies of the buckets with boxes grown by the skin, for recording walks
+  std::vector<Node<Data>*> skin_leaves;
 
   CProxy_TreeCanopy<Data> tc_proxy;
   CProxy_CacheManager<Data> cm_proxy;
@@ -39,10 +55,16 @@ struct Partition : public CBase_Partition<Data> {
   Partition(int, CProxy_CacheManager<Data>, CProxy_Resumer<Data>, TCHolder<Data>);
   Partition(CkMigrateMessage * msg){delete msg;};
 
-  template<typename Visitor> void startDown();
+  template<typename Visitor> void startDown(paratreet::TraversalOptions);
+  template<typename Visitor> Traverser<Data>* makeDownTraverser(paratreet::TraversalOptions);
   template<typename Visitor> void startUpAndDown();
+  template<typename Visitor> void startDual();
+  template<typename Visitor> void startFMM();
+  void startSubstep(int);
   void goDown();
+  void adoptStolen();
   void interact(const CkCallback& cb);
+  void collectStats(const CkCallback& cb);
 
   void addLeaves(const std::vector<Node<Data>*>&, int);
   void receiveLeaves(std::vector<Key>, Key, int, TPHolder<Data>);
@@ -68,6 +90,9 @@ private:
     bool if_flush = false;
   };
   PerturbRequest saved_perturb;
+  // Running walks keep evicted cache units alive (CacheManager::beginWalk)
+  bool walking = false;
+  size_t walk_epoch = 0;
 
 private:
   void initLocalBranches();
@@ -76,6 +101,10 @@ private:
   void flush(CProxy_Reader, std::vector<Particle>&);
   void makeLeaves(const std::vector<Key>&, int);
   void doPerturb();
+  int activeRung() const;
+  void findTargets();
+  void beginWalk();
+  void endWalkIfFinished();
 };
 
 template <typename Data>
@@ -98,21 +127,69 @@ void Partition<Data>::initLocalBranches() {
   r_local->part_proxy = this->thisProxy;
   r_local->resume_nodes_per_part.resize(n_partitions);
   cm_local = cm_proxy.ckLocalBranch();
-  cm_local->lockMaps();
-  cm_local->partition_lookup.emplace(this->thisIndex, this);
-  cm_local->unlockMaps();
+  cm_local->partition_lookup.insert(this->thisIndex, this);
   r_local->cm_local = cm_local;
   cm_local->r_proxy = r_proxy;
+  cm_local->tc_proxy = tc_proxy;
+  auto& config = treespec.ckLocalBranch()->getConfiguration();
+  stats.configure(config.collect_stats, config.stats_sample_period);
+  r_local->stats.configure(config.collect_stats, config.stats_sample_period);
 }
 
 template <typename Data>
 template <typename Visitor>
-void Partition<Data>::startDown()
+void Partition<Data>::startDown(paratreet::TraversalOptions options)
 {
   initLocalBranches();
-  interactions.resize(leaves.size());
-  traverser.reset(new DownTraverser<Data, Visitor>(leaves, *this));
+  findTargets();
+  interactions.reset(targets.size() * paratreet::VisitorSlots<Visitor>::size);
+  // Lists are kept for the full set of buckets only
+  if (targets.size() != leaves.size()) options.replay_period = 0;
+  const bool replay = options.replay_period > 1 && paratreet::VisitorSlots<Visitor>::size == 1;
+  if (replay && !saved_interactions.empty() && saved_interactions.age + 1 < options.replay_period) {
+    traverser.reset(new ReplayTraverser<Data, Visitor>(*this, options));
+  }
+  else {
+    traverser.reset(makeDownTraverser<Visitor>(options));
+  }
+  beginWalk();
   traverser->start();
+  endWalkIfFinished();
+}
+
+// A walk that records its lists for replays tests opening criteria against
+// buckets grown by the skin, so that the lists stay valid while buckets and
+// sources move less than that
+template <typename Data>
+template <typename Visitor>
+Traverser<Data>* Partition<Data>::makeDownTraverser(paratreet::TraversalOptions options)
+{
+  auto walk_leaves = targets;
+  if (options.replay_period > 1 && paratreet::VisitorSlots<Visitor>::size == 1) {
+    options.deferred = true;
+    options.group_walk = false;
+    for (auto skin_leaf : skin_leaves) delete skin_leaf;
+    skin_leaves.clear();
+    for (auto leaf : targets) {
+      auto node = treespec.ckLocalBranch()->template makeNode<Data>(
+        leaf->key, leaf->depth, leaf->n_particles, const_cast<Particle*>(leaf->particles()),
+        -1, -1, true, nullptr, -1
+        );
+      node->type = Node<Data>::Type::Leaf;
+      node->home_pe = leaf->home_pe;
+      node->data = leaf->data;
+      node->data.box.lesser_corner -= Vector3D<Real>(options.replay_skin);
+      node->data.box.greater_corner += Vector3D<Real>(options.replay_skin);
+      skin_leaves.push_back(node);
+    }
+    walk_leaves = skin_leaves;
+  }
+  if (options.bucket_bits && !options.group_walk) {
+    bucket_bit_arenas.reset();
+    return new DownTraverser<Data, Visitor, BucketBits>(walk_leaves, *this, bucket_bit_arenas, options);
+  }
+  bucket_arenas.reset();
+  return new DownTraverser<Data, Visitor>(walk_leaves, *this, bucket_arenas, options);
 }
 
 template <typename Data>
@@ -120,15 +197,113 @@ template <typename Visitor>
 void Partition<Data>::startUpAndDown()
 {
   initLocalBranches();
-  interactions.resize(leaves.size());
+  targets = leaves;
+  interactions.reset(leaves.size());
   traverser.reset(new UpnDTraverser<Data, Visitor>(*this));
+  beginWalk();
+  traverser->start();
+  endWalkIfFinished();
+}
+
+template <typename Data>
+template <typename Visitor>
+void Partition<Data>::startDual()
+{
+  initLocalBranches();
+  targets = leaves;
+  interactions.reset(leaves.size());
+  traverser.reset(new DualTraverser<Data, Visitor>(*this));
+  beginWalk();
+  traverser->start();
+  endWalkIfFinished();
+}
+
+template <typename Data>
+template <typename Visitor>
+void Partition<Data>::startFMM()
+{
+  initLocalBranches();
+  targets = leaves;
+  interactions.reset(leaves.size());
+  traverser.reset(new FmmTraverser<Data, Visitor>(*this));
+  beginWalk();
   traverser->start();
+  endWalkIfFinished();
+}
+
+template <typename Data>
+void Partition<Data>::startSubstep(int substepi)
+{
+  substep = substepi;
+  Particle::currentActiveRung().store(activeRung(), std::memory_order_relaxed);
+}
+
+// Lowest rung whose particles get a force on this sub-step; rung r steps
+// every 2^(max_rung - r) sub-steps, and everything steps on sub-step 0
+template <typename Data>
+int Partition<Data>::activeRung() const
+{
+  return Particle::activeRung(substep, treespec.ckLocalBranch()->getConfiguration().max_rung);
+}
+
+// Down walks only target buckets with active particles. Those particles
+// accumulate this sub-step's acceleration from zero; inactive particles
+// sharing their buckets are masked in SpatialNode::applyAcceleration and
+// keep the acceleration of their last full step.
+template <typename Data>
+void Partition<Data>::findTargets()
+{
+  targets.clear();
+  if (treespec.ckLocalBranch()->getConfiguration().max_rung == 0) {
+    targets = leaves;
+    return;
+  }
+  const int active_rung = activeRung();
+  for (auto leaf : leaves) {
+    bool has_active = false;
+    for (int i = 0; i < leaf->n_particles; i++) {
+      auto& particle = leaf->particles()[i];
+      if (particle.rung >= active_rung) {
+        leaf->applyAcceleration(i, -particle.acceleration);
+        has_active = true;
+      }
+    }
+    if (has_active) targets.push_back(leaf);
+  }
+}
+
+template <typename Data>
+void Partition<Data>::beginWalk()
+{
+  if (walking) cm_local->endWalk(walk_epoch);
+  walk_epoch = cm_local->beginWalk();
+  walking = true;
+}
+
+template <typename Data>
+void Partition<Data>::endWalkIfFinished()
+{
+  if (walking && traverser->isFinished()) {
+    cm_local->endWalk(walk_epoch);
+    walking = false;
+  }
 }
 
 template <typename Data>
 void Partition<Data>::goDown()
 {
   traverser->resumeTrav();
+  endWalkIfFinished();
+  if (saved_perturb.waiting && traverser->isFinished()) {
+    doPerturb();
+  }
+}
+
+template <typename Data>
+void Partition<Data>::adoptStolen()
+{
+  traverser->adoptStolen();
+  endWalkIfFinished();
   if (saved_perturb.waiting && traverser->isFinished()) {
     doPerturb();
   }
@@ -141,6 +316,24 @@ void Partition<Data>::interact(const CkCallback& cb)
   this->contribute(cb);
 }
 
+// Reduces the largest and total estimated visitor time over Partitions, and
+// hands the counters on to the PE's Resumer for the per-PE reduction
+template <typename Data>
+void Partition<Data>::collectStats(const CkCallback& cb)
+{
+  double load = stats.estimatedTime();
+  r_local->stats.merge(stats);
+  stats.reset();
+  const size_t numTuples = 2;
+  CkReduction::tupleElement tupleRedn[] = {
+    CkReduction::tupleElement(sizeof(load), &load, CkReduction::max_double),
+    CkReduction::tupleElement(sizeof(load), &load, CkReduction::sum_double)
+  };
+  CkReductionMsg * msg = CkReductionMsg::buildFromTuple(tupleRedn, numTuples);
+  msg->setCallback(cb);
+  this->contribute(msg);
+}
+
 template <typename Data>
 void Partition<Data>::addLeaves(const std::vector<Node<Data>*>& leaf_ptrs, int subtree_idx) {
   receive_lock.lock();
@@ -174,35 +367,32 @@ void Partition<Data>::addLeaves(const std::vector<Node<Data>*>& leaf_ptrs, int s
 
 template <typename Data>
 void Partition<Data>::receiveLeaves(std::vector<Key> leaf_keys, Key tp_key, int subtree_idx, TPHolder<Data> tp_holder) {
-  cm_local->lockMaps();
-  auto && local_tps = cm_proxy.ckLocalBranch()->local_tps;
-  bool found = local_tps.find(tp_key) != local_tps.end();
+  // Checked while holding the subtree's copy entry, which receiveSubtree
+  // reads only after adding the copy to local_tps
+  bool found = false, should_request = false;
+  cm_local->subtree_copy_started.update(subtree_idx, [&](std::vector<int>& out) {
+    found = cm_local->local_tps.contains(tp_key);
+    if (!found) {
+      lookup_leaf_keys[subtree_idx] = leaf_keys;
+      should_request = out.empty();
+      out.push_back(this->thisIndex);
+    }
+  });
   if (found) {
-    cm_local->unlockMaps();
     makeLeaves(leaf_keys, subtree_idx);
   }
-  else {
-    lookup_leaf_keys[subtree_idx] = leaf_keys;
-    auto& out = cm_local->subtree_copy_started[subtree_idx];
-    bool should_request = out.empty();
-    out.push_back(this->thisIndex);
-    cm_local->unlockMaps();
-    if (should_request) {
-      tp_holder.proxy[subtree_idx].requestCopy(cm_local->thisIndex, this->thisProxy);
-    }
+  else if (should_request) {
+    tp_holder.proxy[subtree_idx].requestCopy(cm_local->thisIndex, this->thisProxy);
   }
 }
 
 template <typename Data>
 void Partition<Data>::makeLeaves(const std::vector<Key>& keys, int subtree_idx) {
-  cm_local->lockMaps();
-  std::vector<Node<Data>*> leaf_ptrs;
-  for (auto && k : keys) {
-    auto it = cm_local->leaf_lookup.find(k);
-    CkAssert(it != cm_local->leaf_lookup.end());
-    leaf_ptrs.push_back(it->second);
+  std::vector<Node<Data>*> leaf_ptrs (keys.size(), nullptr);
+  for (int i = 0; i < keys.size(); i++) {
+    bool found = cm_local->leaf_lookup.find(keys[i], leaf_ptrs[i]);
+    CkAssert(found);
   }
-  cm_local->unlockMaps();
   addLeaves(leaf_ptrs, subtree_idx);
 }
 
@@ -224,7 +414,11 @@ template <typename Data>
 void Partition<Data>::reset()
 {
   if (saved_perturb.waiting) CkAbort("never did the perturb");
+  if (walking) cm_local->endWalk(walk_epoch);
+  walking = false;
   traverser.reset();
+  for (auto skin_leaf : skin_leaves) delete skin_leaf;
+  skin_leaves.clear();
   for (int i = 0; i < leaves.size(); i++) {
     if (leaves[i] != tree_leaves[i]) {
       leaves[i]->freeParticles();
@@ -233,8 +427,9 @@ void Partition<Data>::reset()
   }
   lookup_leaf_keys.clear();
   leaves.clear();
+  targets.clear();
   tree_leaves.clear();
-  interactions.clear();
+  interactions.reset(0);
 }
 
 template <typename Data>
@@ -254,9 +449,7 @@ void Partition<Data>::pup(PUP::er& p)
 
 template <typename Data>
 void Partition<Data>::erasePartition() {
-  cm_local->lockMaps();
   cm_local->partition_lookup.erase(this->thisIndex);
-  cm_local->unlockMaps();
 }
 
 template <typename Data>
@@ -278,8 +471,24 @@ void Partition<Data>::doPerturb()
   std::vector<Particle> particles;
   copyParticles(particles);
   r_local->countPartitionParticles(particles.size());
-  for (auto && p : particles) {
-    p.perturb(saved_perturb.timestep, readers.ckLocalBranch()->universe.box);
+  auto& config = treespec.ckLocalBranch()->getConfiguration();
+  auto& universe = readers.ckLocalBranch()->universe.box;
+  if (config.max_rung == 0) {
+    for (auto && p : particles) {
+      p.perturb(saved_perturb.timestep, universe);
+    }
+  }
+  else {
+    // Block time steps: the timestep is one sub-step, active particles kick
+    // by their rung's step and may move to another rung, everyone drifts
+    const int active_rung = activeRung();
+    for (auto && p : particles) {
+      if (p.rung >= active_rung) {
+        p.kick(saved_perturb.timestep * (1 << (config.max_rung - p.rung)));
+        p.rung = p.chooseRung(saved_perturb.timestep, substep, config.max_rung, config.rung_eta);
+      }
+      p.drift(saved_perturb.timestep, universe);
+    }
   }
 
   if (saved_perturb.if_flush) {
@@ -4,34 +4,71 @@
 #include "paratreet.decl.h"
 #include "common.h"
 #include "Partition.h"
-#include <unordered_map>
+#include "WorkPool.h"
+#include "KeyMap.h"
+#include "TraversalStats.h"
+#include <memory>
 #include <vector>
 
 template <typename Data>
 class Resumer : public CBase_Resumer<Data> {
 public: // these need to be seen by other local chares
   CProxy_Partition<Data> part_proxy;
-  CacheManager<Data>* cm_local;
+  CacheManager<Data>* cm_local = nullptr;
   std::vector<std::queue<Node<Data>*>> resume_nodes_per_part;
-  std::unordered_map<Key, std::vector<int>> waiting;
+  KeyMap<SmallVector<int, 4>> waiting; // key -> indices of waiting Partitions
+  // Work done on this PE outside its own Partitions' walks, plus cache wait
+  // times; Partitions fold theirs in when stats are collected
+  TraversalStats stats;
+
+private:
+  std::shared_ptr<StealableWork> stolen;
+  KeyMap<double> wait_start; // key -> time of the first wait on it
 
 private: // stats
-  unsigned long long n_part_ints = 0ull;
-  unsigned long long n_node_ints = 0ull;
-  unsigned long long n_opens     = 0ull;
-  unsigned long long n_closes    = 0ull;
   unsigned n_partition_particles = 0u;
   unsigned n_subtree_particles   = 0u;
 
 public:
+  Resumer() {
+    // Idle PEs look for traversal work published by busy Partitions
+    CcdCallOnConditionKeep(CcdPROCESSOR_BEGIN_IDLE, (CcdVoidFn)tryToSteal, this);
+    CcdCallOnConditionKeep(CcdPROCESSOR_STILL_IDLE, (CcdVoidFn)tryToSteal, this);
+  }
+
+  // Only PEs that have hosted a Partition know the CacheManager; the stolen
+  // work itself runs from a message so that quiescence waits for it. Runs
+  // on every idle poll, so the pool lock is only taken when it has work
+  static void tryToSteal(void* arg, double) {
+    auto self = static_cast<Resumer<Data>*>(arg);
+    if (!self->cm_local || self->stolen || self->cm_local->work_pool.empty()) return;
+    self->stolen = self->cm_local->work_pool.steal();
+    if (self->stolen) self->thisProxy[CkMyPe()].runStolen();
+  }
+
+  void runStolen() {
+    auto work = std::move(stolen);
+    stolen.reset();
+    work->run();
+  }
+
+  // Reduces the PE's traversal stats: sums of every counter, then the
+  // largest single wait and the most loaded PE
   void collectAndResetStats(CkCallback cb) {
-#if COUNT_INTERACTIONS
-     CkPrintf("%lu particles on pe %d\n", n_partition_particles, CkMyPe());
-     unsigned long long intrn_counts [4] = {n_node_ints, n_part_ints, n_opens, n_closes};
-     CkPrintf("on PE %d: %llu node-particle interactions, %llu bucket-particle interactions %llu node opens, %llu node closes\n", CkMyPe(), intrn_counts[0], intrn_counts[1], intrn_counts[2], intrn_counts[3]);
-     this->contribute(4 * sizeof(unsigned long long), &intrn_counts, CkReduction::sum_ulong_long, cb);
-#endif
-     reset();
+    std::vector<unsigned long long> counts;
+    std::vector<double> sums;
+    stats.pack(counts, sums);
+    double maxima[2] = {stats.max_wait, stats.estimatedTime()};
+    const size_t numTuples = 3;
+    CkReduction::tupleElement tupleRedn[] = {
+      CkReduction::tupleElement(counts.size() * sizeof(unsigned long long), counts.data(), CkReduction::sum_ulong_long),
+      CkReduction::tupleElement(sums.size() * sizeof(double), sums.data(), CkReduction::sum_double),
+      CkReduction::tupleElement(sizeof(maxima), maxima, CkReduction::max_double)
+    };
+    CkReductionMsg * msg = CkReductionMsg::buildFromTuple(tupleRedn, numTuples);
+    msg->setCallback(cb);
+    this->contribute(msg);
+    reset();
   }
 
   void collectMetaData (const CkCallback & cb) {
@@ -53,20 +90,17 @@ public:
     }
     CkAssert(waiting.empty()); // should have gotten rid of them
 #endif
-    n_part_ints = n_node_ints = n_opens = n_closes = 0ull;
+    waiting.clear();
+    wait_start.clear();
+    stats.reset();
     n_partition_particles = n_subtree_particles = 0u;
   }
 
-  void countLeafInts(int n_ints) {
-    n_part_ints += n_ints;
-  }
-
-  void countNodeInts(int n_ints) {
-    n_node_ints += n_ints;
-  }
-
-  void countOpen(bool should_open) {
-    should_open ? n_opens++ : n_closes++;
+  // Partitions waiting on key; the first one to wait starts its clock
+  SmallVector<int, 4>& waitersOf(Key key) {
+    auto& waiters = waiting[key];
+    if (stats.enabled && waiters.empty()) wait_start[key] = CkWallTimer();
+    return waiters;
   }
 
   void countPartitionParticles(int n_parts) {
@@ -77,19 +111,30 @@ public:
     n_subtree_particles += n_parts;
   }
 
+  void processKeys(const std::vector<Key>& keys) {
+    for (auto key : keys) process(key);
+  }
+
   void process(Key key) {
     CkAssert(!resume_nodes_per_part.empty());
-    auto node = cm_local->root->getDescendant(key);
+    auto node = cm_local->findNode(key);
     CkAssert(node && node->key == key);
-    auto it = waiting.find(key);
-    if (it == waiting.end()) return;
-    for (auto part_index : it->second) {
+    if (stats.enabled) {
+      auto start = wait_start.find(key);
+      if (start) {
+        stats.countWait(CkWallTimer() - *start);
+        wait_start.erase(key);
+      }
+    }
+    auto waiters = waiting.find(key);
+    if (!waiters) return;
+    for (auto part_index : *waiters) {
       auto && resume_nodes = resume_nodes_per_part[part_index];
       bool should_resume = resume_nodes.empty();
       resume_nodes.push(node);
       if (should_resume) part_proxy[part_index].goDown();
     }
-    waiting.erase(it);
+    waiting.erase(key);
   }
 };
 
@@ -0,0 +1,80 @@
+#ifndef PARATREET_SHARDEDMAP_H_
+#define PARATREET_SHARDEDMAP_H_
+
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+// Hash map split into independently locked shards, for lookups that every
+// PE of a process makes at once (CacheManager in nodegroup mode). Threads
+// only contend when their keys land in the same shard.
+template <typename K, typename V, int N_SHARDS = 64>
+class ShardedMap {
+public:
+  // Keeps an existing value, like std::unordered_map::emplace
+  bool insert(const K& key, const V& value) {
+    auto& shard = shardOf(key);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    return shard.map.emplace(key, value).second;
+  }
+
+  bool find(const K& key, V& value) const {
+    auto& shard = shardOf(key);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    auto it = shard.map.find(key);
+    if (it == shard.map.end()) return false;
+    value = it->second;
+    return true;
+  }
+
+  bool contains(const K& key) const {
+    auto& shard = shardOf(key);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    return shard.map.count(key);
+  }
+
+  // Whether key was there
+  bool erase(const K& key) {
+    auto& shard = shardOf(key);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    return shard.map.erase(key) > 0;
+  }
+
+  // Runs fn on the value of key, default constructed if absent, while
+  // holding its shard
+  template <typename Fn>
+  auto update(const K& key, Fn&& fn) -> decltype(fn(std::declval<V&>())) {
+    auto& shard = shardOf(key);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    return fn(shard.map[key]);
+  }
+
+  void clear() {
+    for (auto& shard : shards) {
+      std::lock_guard<std::mutex> guard(shard.lock);
+      shard.map.clear();
+    }
+  }
+
+private:
+  struct alignas(64) Shard {
+    mutable std::mutex lock;
+    std::unordered_map<K, V> map;
+  };
+
+  Shard& shardOf(const K& key) {return shards[index(key)];}
+  const Shard& shardOf(const K& key) const {return shards[index(key)];}
+
+  // Neighbouring tree keys differ in their low bits only; spread them out
+  static size_t index(const K& key) {
+    size_t h = std::hash<K>()(key);
+    h ^= h >> 17;
+    h *= 0x9E3779B97F4A7C15ull;
+    return (h >> 32) % N_SHARDS;
+  }
+
+  Shard shards[N_SHARDS];
+};
+
+#endif // PARATREET_SHARDEDMAP_H_
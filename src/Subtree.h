@@ -176,10 +176,10 @@ void Subtree<Data>::sendLeaves(CProxy_Partition<Data> part)
   }
 
   for (auto && part_receiver : part_idx_to_leaf) {
-    auto it = cm_proxy.ckLocalBranch()->partition_lookup.find(part_receiver.first);
-    if (it != cm_proxy.ckLocalBranch()->partition_lookup.end()) {
+    Partition<Data>* local_part = nullptr;
+    if (cm_proxy.ckLocalBranch()->partition_lookup.find(part_receiver.first, local_part)) {
       std::vector<Node<Data>*> leaf_ptrs (part_receiver.second.begin(), part_receiver.second.end());
-      it->second->addLeaves(leaf_ptrs, this->thisIndex);
+      local_part->addLeaves(leaf_ptrs, this->thisIndex);
     }
     else {
       std::vector<Key> lookup_leaf_keys;
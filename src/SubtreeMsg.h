@@ -0,0 +1,107 @@
+#ifndef PARATREET_SUBTREEMSG_H_
+#define PARATREET_SUBTREEMSG_H_
+
+#include "Particle.h"
+#include "Node.h"
+#include "common.h"
+#include "paratreet.decl.h"
+
+#include <algorithm>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Cached subtrees in a single buffer: the serialized node table (key and
+// SpatialNode of every node, each subtree in depth-first order) and then
+// the particles of its leaves, in the same order. The receiver's cached
+// leaves point straight into the particle block, so the message lives until
+// the last of them is freed. A reply for several requests lists where each
+// subtree starts; with Configuration::persist_cache it also carries the
+// owner's digest of every node.
+struct SubtreeMsg : public CMessage_SubtreeMsg {
+  char* node_table;
+  Particle* particles;
+  int* roots; // first node and tp_index of every subtree, in pairs
+  uint64_t* digests; // one per node, or none
+  int n_nodes;
+  int n_particles;
+  int n_roots;
+  int n_digests;
+  int cm_index;
+
+  template <typename Data>
+  static SubtreeMsg* pack(const std::vector<Node<Data>*>& nodes, const std::vector<std::pair<int, int>>& roots,
+                          const std::vector<uint64_t>& digests, int cm_index, int priority);
+
+  template <typename Data>
+  std::vector<std::pair<Key, SpatialNode<Data>>> unpackNodes();
+
+  int rootNode(int i) const {return roots[2 * i];}
+  int rootTP(int i) const {return roots[2 * i + 1];}
+
+  // Key of the first subtree's top node, without unpacking the rest
+  Key topKey() const {
+    Key key;
+    PUP::fromMem unpacker (node_table);
+    unpacker | key;
+    return key;
+  }
+
+  // Hands the message over to the nodes built on it; call once
+  std::shared_ptr<void> share() {
+    return std::shared_ptr<void>(this, [](void* msg) {CkFreeMsg(msg);});
+  }
+};
+
+template <typename Data>
+inline SubtreeMsg* SubtreeMsg::pack(const std::vector<Node<Data>*>& nodes, const std::vector<std::pair<int, int>>& roots,
+                                    const std::vector<uint64_t>& digests, int cm_index, int priority) {
+  int n_particles = 0;
+  PUP::sizer sizer;
+  for (auto node : nodes) {
+    if (node->type == Node<Data>::Type::Leaf) n_particles += node->n_particles;
+    Key key = node->key;
+    SpatialNode<Data> copy (*node, nullptr);
+    sizer | key;
+    sizer | copy;
+  }
+  int sizes[] = {(int)sizer.size(), n_particles, 2 * (int)roots.size(), (int)digests.size()};
+  auto msg = new (sizes, 8 * sizeof(int)) SubtreeMsg;
+  PUP::toMem packer (msg->node_table);
+  Particle* out = msg->particles;
+  for (auto node : nodes) {
+    Key key = node->key;
+    SpatialNode<Data> copy (*node, nullptr);
+    packer | key;
+    packer | copy;
+    if (node->type == Node<Data>::Type::Leaf) {
+      out = std::copy(node->particles(), node->particles() + node->n_particles, out);
+    }
+  }
+  for (int i = 0; i < roots.size(); i++) {
+    msg->roots[2 * i] = roots[i].first;
+    msg->roots[2 * i + 1] = roots[i].second;
+  }
+  std::copy(digests.begin(), digests.end(), msg->digests);
+  msg->n_nodes = nodes.size();
+  msg->n_particles = n_particles;
+  msg->n_roots = roots.size();
+  msg->n_digests = digests.size();
+  msg->cm_index = cm_index;
+  *(int*)CkPriorityPtr(msg) = priority;
+  CkSetQueueing(msg, CK_QUEUEING_IFIFO);
+  return msg;
+}
+
+template <typename Data>
+inline std::vector<std::pair<Key, SpatialNode<Data>>> SubtreeMsg::unpackNodes() {
+  std::vector<std::pair<Key, SpatialNode<Data>>> nodes (n_nodes);
+  PUP::fromMem unpacker (node_table);
+  for (auto& node : nodes) {
+    unpacker | node.first;
+    unpacker | node.second;
+  }
+  return nodes;
+}
+
+#endif // PARATREET_SUBTREEMSG_H_
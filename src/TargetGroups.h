@@ -0,0 +1,136 @@
+#ifndef PARATREET_TARGETGROUPS_H_
+#define PARATREET_TARGETGROUPS_H_
+
+#include "Node.h"
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// The local subtrees of a Partition, numbered as traversal targets. Targets
+// [0, n_buckets) are the buckets themselves; every Internal node whose
+// non-empty leaves are all buckets of the Partition is a group target
+// numbered after them. Roots are the largest targets, which together cover
+// each bucket exactly once.
+template <typename Data>
+class TargetGroups {
+public:
+  void build(const std::vector<Node<Data>*>& leavesi) {
+    leaves = leavesi;
+    for (int i = 0; i < leaves.size(); i++) bucket_index[leaves[i]] = i;
+    std::unordered_map<Node<Data>*, bool> memo;
+    std::unordered_set<Node<Data>*> seen;
+    for (auto leaf : leaves) {
+      Node<Data>* top = leaf;
+      while (top->parent && top->parent->type == Node<Data>::Type::Internal && isOwned(top->parent, memo)) {
+        top = top->parent;
+      }
+      if (seen.insert(top).second) root_targets.push_back(makeTarget(top));
+    }
+  }
+
+  int numBuckets() const {return leaves.size();}
+  int numTargets() const {return leaves.size() + groups.size();}
+  bool isGroup(int target) const {return target >= numBuckets();}
+  const std::vector<int>& roots() const {return root_targets;}
+
+  Node<Data>* node(int target) const {
+    return isGroup(target) ? groups[target - numBuckets()].node : leaves[target];
+  }
+
+  // Bucket index of node, or -1 if it is not one of the buckets
+  int bucketIndex(Node<Data>* node) const {
+    auto it = bucket_index.find(node);
+    return it == bucket_index.end() ? -1 : it->second;
+  }
+
+  // Target number of node, or -1 if it is neither a bucket nor a group
+  int targetIndex(Node<Data>* node) const {
+    auto it = target_index.find(node);
+    return it == target_index.end() ? bucketIndex(node) : it->second;
+  }
+
+  int numBucketsUnder(int target) const {
+    return isGroup(target) ? groups[target - numBuckets()].n_buckets : 1;
+  }
+
+  template <typename Fn>
+  void forEachChild(int target, Fn&& fn) const {
+    auto& group = groups[target - numBuckets()];
+    for (int i = 0; i < group.n_children; i++) fn(children[group.first_child + i]);
+  }
+
+  template <typename Fn>
+  void forEachBucket(int target, Fn&& fn) const {
+    if (!isGroup(target)) {
+      fn(target);
+      return;
+    }
+    auto& group = groups[target - numBuckets()];
+    for (int i = 0; i < group.n_buckets; i++) fn(buckets[group.first_bucket + i]);
+  }
+
+private:
+  struct Group {
+    Node<Data>* node;
+    int first_child, n_children;
+    int first_bucket, n_buckets;
+  };
+
+  // A node qualifies if every non-empty leaf under it is one of our buckets
+  bool isOwned(Node<Data>* node, std::unordered_map<Node<Data>*, bool>& memo) {
+    auto it = memo.find(node);
+    if (it != memo.end()) return it->second;
+    bool owned = false;
+    switch (node->type) {
+      case Node<Data>::Type::Leaf:
+        owned = bucket_index.count(node);
+        break;
+      case Node<Data>::Type::EmptyLeaf:
+        owned = true;
+        break;
+      case Node<Data>::Type::Internal:
+        owned = true;
+        for (int i = 0; i < node->n_children && owned; i++) {
+          owned = isOwned(node->getChild(i), memo);
+        }
+        break;
+      default:
+        break;
+    }
+    memo[node] = owned;
+    return owned;
+  }
+
+  // Numbers node and, for a group, everything under it. A group's buckets
+  // are laid out contiguously in depth-first order.
+  int makeTarget(Node<Data>* node) {
+    auto it = bucket_index.find(node);
+    if (it != bucket_index.end()) {
+      buckets.push_back(it->second);
+      return it->second;
+    }
+    const int group = groups.size();
+    groups.push_back({node, 0, 0, (int)buckets.size(), 0});
+    target_index[node] = numBuckets() + group;
+    std::vector<int> child_targets;
+    for (int i = 0; i < node->n_children; i++) {
+      Node<Data>* child = node->getChild(i);
+      if (child->type != Node<Data>::Type::EmptyLeaf) child_targets.push_back(makeTarget(child));
+    }
+    groups[group].first_child = children.size();
+    groups[group].n_children = child_targets.size();
+    groups[group].n_buckets = buckets.size() - groups[group].first_bucket;
+    children.insert(children.end(), child_targets.begin(), child_targets.end());
+    return numBuckets() + group;
+  }
+
+  std::vector<Node<Data>*> leaves;
+  std::unordered_map<Node<Data>*, int> bucket_index;
+  std::unordered_map<Node<Data>*, int> target_index; // groups only
+  std::vector<Group> groups;
+  std::vector<int> children;
+  std::vector<int> buckets;
+  std::vector<int> root_targets;
+};
+
+#endif // PARATREET_TARGETGROUPS_H_
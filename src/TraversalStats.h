@@ -0,0 +1,161 @@
+#ifndef PARATREET_TRAVERSALSTATS_H_
+#define PARATREET_TRAVERSALSTATS_H_
+
+#include "charm++.h"
+#include <algorithm>
+#include <vector>
+
+// Traversal counters of one Partition, or of the work a PE did for others
+// (stolen walks, cache waits), over one iteration. Everything is a no-op
+// unless enabled through Configuration::collect_stats. Visitor calls are
+// timed one in sample_period; totals are extrapolated from the samples.
+struct TraversalStats {
+  static constexpr int max_depth = 64;
+  enum Call {eOpen = 0, eNode, eLeaf, n_calls};
+
+  bool enabled = false;
+  int sample_period = 64;
+
+  unsigned long long opens[max_depth] = {};  // by source depth
+  unsigned long long closes[max_depth] = {};
+  unsigned long long n_calls_of[n_calls] = {};
+  unsigned long long n_part_ints = 0ull; // particle-particle (P2P)
+  unsigned long long n_node_ints = 0ull; // node-particle (M2P)
+  unsigned long long n_misses = 0ull;    // walks parked on a remote node
+  unsigned long long n_requests = 0ull;  // fetches sent for remote nodes
+  unsigned long long n_waits = 0ull;     // fetches answered
+  unsigned long long n_timed[n_calls] = {};
+  double time[n_calls] = {};
+  double wait_time = 0.;
+  double max_wait = 0.;
+
+  // Times the enclosing scope if this call is a sampled one
+  class Sample {
+  public:
+    Sample(TraversalStats* statsi, Call calli) : stats(statsi), call(calli) {
+      if (stats->enabled && --stats->until_sample <= 0) {
+        stats->until_sample = stats->sample_period;
+        start = CkWallTimer();
+      }
+    }
+    ~Sample() {
+      if (start >= 0.) {
+        stats->time[call] += CkWallTimer() - start;
+        stats->n_timed[call]++;
+      }
+    }
+
+  private:
+    TraversalStats* stats;
+    Call call;
+    double start = -1.;
+  };
+
+  void configure(bool enabledi, int sample_periodi) {
+    enabled = enabledi;
+    sample_period = std::max(sample_periodi, 1);
+  }
+
+  void countOpen(int depth, bool should_open) {
+    if (!enabled) return;
+    depth = std::min(depth, max_depth - 1);
+    should_open ? opens[depth]++ : closes[depth]++;
+    n_calls_of[eOpen]++;
+  }
+
+  void countLeaf(int n_ints) {
+    if (!enabled) return;
+    n_calls_of[eLeaf]++;
+    n_part_ints += n_ints;
+  }
+
+  void countNode(int n_ints) {
+    if (!enabled) return;
+    n_calls_of[eNode]++;
+    n_node_ints += n_ints;
+  }
+
+  void countMiss() {if (enabled) n_misses++;}
+  void countRequest() {if (enabled) n_requests++;}
+
+  void countWait(double seconds) {
+    if (!enabled) return;
+    n_waits++;
+    wait_time += seconds;
+    max_wait = std::max(max_wait, seconds);
+  }
+
+  // Estimated seconds spent in visitor calls of the given kind
+  double estimatedTime(int call) const {
+    if (n_timed[call] == 0) return 0.;
+    return time[call] / n_timed[call] * n_calls_of[call];
+  }
+
+  double estimatedTime() const {
+    double total = 0.;
+    for (int call = 0; call < n_calls; call++) total += estimatedTime(call);
+    return total;
+  }
+
+  void merge(const TraversalStats& other) {
+    std::vector<unsigned long long> counts;
+    std::vector<double> sums;
+    other.pack(counts, sums);
+    unpack(counts.data(), sums.data(), true);
+    max_wait = std::max(max_wait, other.max_wait);
+  }
+
+  void reset() {
+    bool was_enabled = enabled;
+    int period = sample_period;
+    *this = TraversalStats();
+    configure(was_enabled, period);
+  }
+
+  // Flattened for sum reductions; unpack() reads the same layout
+  void pack(std::vector<unsigned long long>& counts, std::vector<double>& sums) const {
+    counts.insert(counts.end(), opens, opens + max_depth);
+    counts.insert(counts.end(), closes, closes + max_depth);
+    counts.insert(counts.end(), n_calls_of, n_calls_of + n_calls);
+    counts.insert(counts.end(), {n_part_ints, n_node_ints, n_misses, n_requests, n_waits});
+    counts.insert(counts.end(), n_timed, n_timed + n_calls);
+    sums.insert(sums.end(), time, time + n_calls);
+    sums.push_back(wait_time);
+  }
+
+  static int numCounts() {return 2 * max_depth + 2 * n_calls + 5;}
+  static int numSums() {return n_calls + 1;}
+
+  void unpack(const unsigned long long* counts, const double* sums, bool add = false) {
+    auto take = [&](unsigned long long& field) {field = (add ? field : 0ull) + *counts++;};
+    for (auto& c : opens) take(c);
+    for (auto& c : closes) take(c);
+    for (auto& c : n_calls_of) take(c);
+    take(n_part_ints);
+    take(n_node_ints);
+    take(n_misses);
+    take(n_requests);
+    take(n_waits);
+    for (auto& c : n_timed) take(c);
+    for (int call = 0; call < n_calls; call++) time[call] = (add ? time[call] : 0.) + sums[call];
+    wait_time = (add ? wait_time : 0.) + sums[n_calls];
+  }
+
+  void print() const {
+    CkPrintf("[Stats] %llu node-particle interactions, %llu particle-particle interactions\n", n_node_ints, n_part_ints);
+    for (int depth = 0; depth < max_depth; depth++) {
+      if (opens[depth] || closes[depth]) {
+        CkPrintf("[Stats] depth %d: %llu opens, %llu closes\n", depth, opens[depth], closes[depth]);
+      }
+    }
+    CkPrintf("[Stats] est. visitor time: open %.3lf ms, node %.3lf ms, leaf %.3lf ms\n",
+        estimatedTime(eOpen) * 1000, estimatedTime(eNode) * 1000, estimatedTime(eLeaf) * 1000);
+    CkPrintf("[Stats] %llu remote misses, %llu requests, mean wait %.3lf ms, max wait %.3lf ms\n",
+        n_misses, n_requests, n_waits ? wait_time / n_waits * 1000 : 0., max_wait * 1000);
+  }
+
+private:
+  int until_sample = 0; // calls left before the next timed one
+};
+
+#endif // PARATREET_TRAVERSALSTATS_H_
@@ -4,36 +4,83 @@
 #include "Subtree.h"
 #include "Partition.h"
 #include "common.h"
+#include "BucketSet.h"
+#include "WorkPool.h"
+#include "KeyMap.h"
+#include "FusedVisitor.h"
+#include "InteractionList.h"
+#include "TargetGroups.h"
+#include "TraversalStats.h"
 #include "paratreet.decl.h"
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <mutex>
 #include <stack>
+#include <type_traits>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 namespace {
 
-template <typename Visitor, typename Node, typename StatCollector>
-inline bool doOpen(Node* source, Node* target, StatCollector* stats) {
-  auto should_open = Visitor::open(*source, *target);
-#if COUNT_INTERACTIONS
-  stats->countOpen(should_open);
-#endif
+template <typename Visitor, typename Node>
+inline bool doOpen(Node* source, Node* target, TraversalStats* stats) {
+  bool should_open;
+  {
+    TraversalStats::Sample sample(stats, TraversalStats::eOpen);
+    should_open = Visitor::open(*source, *target);
+  }
+  stats->countOpen(source->depth, should_open);
   return should_open;
 }
 
-template <typename Visitor, typename Node, typename StatCollector>
-inline void doLeaf(Node* source, Node* target, StatCollector* stats) {
-  Visitor::leaf(*source, *target);
-#if COUNT_INTERACTIONS
-  stats->countLeafInts(source->n_particles * target->n_particles);
-#endif
+template <typename Visitor, typename Node>
+inline void doLeaf(Node* source, Node* target, TraversalStats* stats) {
+  {
+    TraversalStats::Sample sample(stats, TraversalStats::eLeaf);
+    Visitor::leaf(*source, *target);
+  }
+  stats->countLeaf(source->n_particles * target->n_particles);
 }
 
-template <typename Visitor, typename Node, typename StatCollector>
-inline void doNode(Node* source, Node* target, StatCollector* stats) {
-  Visitor::node(*source, *target);
-#if COUNT_INTERACTIONS
-  stats->countNodeInts(target->n_particles);
-#endif
+template <typename Visitor, typename Node>
+inline void doNode(Node* source, Node* target, TraversalStats* stats) {
+  {
+    TraversalStats::Sample sample(stats, TraversalStats::eNode);
+    Visitor::node(*source, *target);
+  }
+  stats->countNode(target->n_particles);
+}
+
+// Same as above for visitor v of a (possibly fused) Visitor
+template <typename Visitor, typename Node>
+inline bool doOpen(int v, Node* source, Node* target, TraversalStats* stats) {
+  bool should_open;
+  {
+    TraversalStats::Sample sample(stats, TraversalStats::eOpen);
+    should_open = paratreet::VisitorSlots<Visitor>::open(v, *source, *target);
+  }
+  stats->countOpen(source->depth, should_open);
+  return should_open;
+}
+
+template <typename Visitor, typename Node>
+inline void doLeaf(int v, Node* source, Node* target, TraversalStats* stats) {
+  {
+    TraversalStats::Sample sample(stats, TraversalStats::eLeaf);
+    paratreet::VisitorSlots<Visitor>::leaf(v, *source, *target);
+  }
+  stats->countLeaf(source->n_particles * target->n_particles);
+}
+
+template <typename Visitor, typename Node>
+inline void doNode(int v, Node* source, Node* target, TraversalStats* stats) {
+  {
+    TraversalStats::Sample sample(stats, TraversalStats::eNode);
+    paratreet::VisitorSlots<Visitor>::node(v, *source, *target);
+  }
+  stats->countNode(target->n_particles);
 }
 
 } // empty namespace
@@ -46,8 +93,42 @@ public:
   virtual void interact() = 0;
   virtual void start() = 0;
   virtual bool isFinished() = 0;
+  // Picks up the results of work run by other PEs, if the traverser shares any
+  virtual void adoptStolen() {}
 
 protected:
+  // Asks for the data behind a remote placeholder, once per node
+  void requestNode(Partition<Data>& part, Node<Data>* node, TraversalStats* stats) {
+    stats->countMiss();
+    bool prev = node->requested.exchange(true);
+    if (!prev) {
+      stats->countRequest();
+      auto opts = CacheManager<Data>::fetchOptions(node->depth);
+      part.cm_local->fetch(node, opts);
+    }
+  }
+
+  // Empties this Partition's resume queue, heaviest node first by weight
+  // (e.g. the number of buckets waiting on it) instead of arrival order
+  template <typename Weight>
+  std::vector<Node<Data>*> takeResumeNodes(Partition<Data>& part, Weight&& weight) {
+    auto && resume_nodes = part.r_local->resume_nodes_per_part[part.thisIndex];
+    std::vector<std::pair<size_t, Node<Data>*>> weighted;
+    while (!resume_nodes.empty()) {
+      auto node = resume_nodes.front();
+      resume_nodes.pop();
+      weighted.emplace_back(weight(node), node);
+    }
+    std::stable_sort(weighted.begin(), weighted.end(),
+      [](const std::pair<size_t, Node<Data>*>& a, const std::pair<size_t, Node<Data>*>& b) {
+        return a.first > b.first;
+      });
+    std::vector<Node<Data>*> nodes;
+    nodes.reserve(weighted.size());
+    for (auto && wn : weighted) nodes.push_back(wn.second);
+    return nodes;
+  }
+
   template <typename Visitor>
   void runSimpleTraversal(Partition<Data>& part, Node<Data>* source_node, int leaf_index)
   {
@@ -57,60 +138,291 @@ protected:
       Node<Data>* node = nodes.top();
       nodes.pop();
       if (node->type == Node<Data>::Type::Leaf || node->type == Node<Data>::Type::CachedRemoteLeaf) {
-        part.interactions[leaf_index].push_back(node);
+        part.interactions.addLeaf(leaf_index, node);
       } else {
-        if (doOpen<Visitor>(node, part.leaves[leaf_index]), part.r_local) {
+        if (doOpen<Visitor>(node, part.leaves[leaf_index], &part.stats)) {
           for (int j = 0; j < node->n_children; j++) {
             nodes.push(node->getChild(j));
           }
         } else {
-          doNode<Visitor>(node, part.leaves[leaf_index], part.r_local);
+          doNode<Visitor>(node, part.leaves[leaf_index], &part.stats);
         }
       }
     }
   }
 
+  // Evaluates the recorded interactions one target bucket at a time. The
+  // list may have been finalized already, e.g. to be saved for replays.
+  // Lists of fused visitors have one row per (bucket, visitor) slot; a
+  // source then appears once per visitor, so per-bucket completion is only
+  // reported for single visitors.
   template <typename Visitor>
   void interactBase(Partition<Data>& part)
   {
-    for (int i = 0; i < part.interactions.size(); i++) {
-      for (Node<Data>* source : part.interactions[i]) {
-        doLeaf<Visitor>(source, part.leaves[i], part.r_local);
+    constexpr int nv = paratreet::VisitorSlots<Visitor>::size;
+    auto& list = part.interactions;
+    if (list.hasPending()) list.finalize();
+    for (int i = 0; i < list.numBuckets(); i++) {
+      Node<Data>* target = part.targets[i / nv];
+      for (auto it = list.nodesBegin(i); it != list.nodesEnd(i); ++it) {
+        doNode<Visitor>(i % nv, *it, target, &part.stats);
+        if (nv == 1) (*it)->finish(1);
+      }
+      for (auto it = list.leavesBegin(i); it != list.leavesEnd(i); ++it) {
+        doLeaf<Visitor>(i % nv, *it, target, &part.stats);
+        if (nv == 1) (*it)->finish(1);
       }
     }
+    list.reset(list.numBuckets());
   }
 };
 
-template <typename Data, typename Visitor>
+template <typename Data, typename Visitor, typename BucketSet = BucketList>
 class DownTraverser : public Traverser<Data> {
 protected:
+  // Active sets hold slots bucket * nv + v, one per (bucket, visitor) pair,
+  // or target indices in a group walk
+  using Slots = paratreet::VisitorSlots<Visitor>;
+  static constexpr int nv = Slots::size;
+  using Word = typename BucketSet::Word;
+  // Pending work on the explicit stack; a frame with no node releases the
+  // arena memory of a finished set of siblings
+  struct Frame {
+    Node<Data>* node;
+    BucketSet active;
+    typename BumpArena<Word>::Mark release;
+  };
+  // Remote node hit by a thief, with the buckets that still need it
+  using Miss = std::pair<Key, std::vector<int>>;
+
+  // State of one walk. The owner walks with the traverser's own state; a
+  // thief brings thread-local scratch and collects its misses instead of
+  // touching the owner's curr_nodes and Resumer
+  struct Walk {
+    TraversalStats* stats;
+    TraversalArenas<Word>& arenas;
+    std::vector<Frame>& stack;
+    std::vector<Miss>* misses;
+  };
+
+  // A (node, buckets) walk published to the node-level work pool
+  class Chunk : public StealableWork {
+  public:
+    Chunk(DownTraverser* travi, Node<Data>* nodei, BucketSet bucketsi)
+      : trav(travi), node(nodei), buckets(bucketsi) {}
+    void run() override {trav->runStolen(node, buckets);}
+
+    DownTraverser* trav;
+    Node<Data>* node;
+    BucketSet buckets;
+  };
+
   std::vector<Node<Data>*> leaves;
   Partition<Data>& part;
-  std::unordered_map<Key, std::vector<int>> curr_nodes;
-  const bool delay_leaf;
+  TraversalArenas<Word>& arenas;
+  KeyMap<SmallVector<BucketSet, 2>> curr_nodes;
+  std::vector<Frame> stack;
+  Walk owner_walk;
+  const bool deferred; // record interactions in part.interactions instead of applying them
+
+  // Work stealing; steal_chunk == 0 means the owner walks everything itself
+  const int steal_chunk;
+  std::vector<std::shared_ptr<Chunk>> chunks;
+  int next_chunk = 0;
+  int n_pending_chunks = 0; // published and not yet claimed by the owner or adopted
+  // The owner gives the PE back after visiting this many nodes (0: never)
+  const int yield_after;
+  bool yielded = false;
+  std::mutex stolen_lock;
+  std::vector<std::vector<Miss>> stolen_misses;
+  // Group walk: active sets hold TargetGroups targets instead of slots
+  const bool group_walk;
+  TargetGroups<Data> groups;
+  // Save the deferred lists for ReplayTraverser before evaluating them
+  const bool record;
+  const Real skin;
 
 protected:
   void startTrav(Node<Data>* new_payload) {
-    std::vector<int> all_leaves;
-    for (int i = 0; i < leaves.size(); i++) all_leaves.push_back(i);
-    recurse(new_payload, all_leaves);
+    if (group_walk) {
+      startGroups(new_payload);
+      return;
+    }
+    if (steal_chunk > 0) {
+      auto& pool = part.cm_local->work_pool;
+      for (int begin = 0; begin < leaves.size(); begin += steal_chunk) {
+        const int end = std::min<int>(begin + steal_chunk, leaves.size());
+        auto buckets = BucketSet::range(numSlots(), begin * nv, end * nv, arenas.waiting);
+        chunks.push_back(std::make_shared<Chunk>(this, new_payload, buckets));
+        pool.publish(chunks.back());
+      }
+      n_pending_chunks = chunks.size();
+    }
+    else push(owner_walk, new_payload, BucketSet::all(numSlots(), arenas.waiting));
+  }
+
+  // Starts from the root targets; stealable chunks are runs of roots
+  // covering about steal_chunk buckets
+  void startGroups(Node<Data>* new_payload) {
+    auto& roots = groups.roots();
+    if (steal_chunk == 0) {
+      push(owner_walk, new_payload, BucketSet::fromList(numSlots(), roots, arenas.waiting));
+      return;
+    }
+    auto& pool = part.cm_local->work_pool;
+    std::vector<int> chunk_roots;
+    int n_chunk_buckets = 0;
+    for (int i = 0; i < roots.size(); i++) {
+      chunk_roots.push_back(roots[i]);
+      n_chunk_buckets += groups.numBucketsUnder(roots[i]);
+      if (n_chunk_buckets >= steal_chunk || i + 1 == roots.size()) {
+        auto targets = BucketSet::fromList(numSlots(), chunk_roots, arenas.waiting);
+        chunks.push_back(std::make_shared<Chunk>(this, new_payload, targets));
+        pool.publish(chunks.back());
+        chunk_roots.clear();
+        n_chunk_buckets = 0;
+      }
+    }
+    n_pending_chunks = chunks.size();
   }
 
 public:
-  DownTraverser(std::vector<Node<Data>*> leavesi, Partition<Data>& parti, bool delay_leafi = false)
-    : leaves(leavesi), part(parti), delay_leaf(delay_leafi)
-  { }
+  DownTraverser(std::vector<Node<Data>*> leavesi, Partition<Data>& parti,
+                TraversalArenas<Word>& arenasi,
+                const paratreet::TraversalOptions& options = paratreet::TraversalOptions())
+    : leaves(leavesi), part(parti), arenas(arenasi),
+      owner_walk {&parti.stats, arenasi, stack, nullptr},
+      deferred(options.deferred), steal_chunk(options.deferred ? 0 : options.steal_chunk),
+      yield_after(options.yield_after),
+      group_walk(options.group_walk && nv == 1 && std::is_same<BucketSet, BucketList>::value),
+      record(options.deferred && options.replay_period > 1 && nv == 1),
+      skin(options.replay_skin)
+  {
+    if (group_walk) groups.build(leaves);
+  }
   virtual ~DownTraverser() = default;
-  virtual bool isFinished() override {return curr_nodes.empty();}
+  virtual bool isFinished() override {
+    return curr_nodes.empty() && stack.empty() && n_pending_chunks == 0;
+  }
   virtual void start() override {
     // Initialize with global root key and leaves
     startTrav(part.cm_local->root);
+    work();
+  }
+  virtual void interact() override {
+    auto& list = part.interactions;
+    if (record && list.hasPending()) {
+      list.finalize();
+      part.saved_interactions.save(list, part.targets, skin);
+    }
+    this->template interactBase<Visitor>(part);
+  }
+
+  // Runs the owner's pending walks and unclaimed chunks. Once yield_after
+  // nodes have been visited the rest is left on the stack and picked up by a
+  // goDown sent to ourselves, so that addCache and other messages queued on
+  // this PE get serviced in between.
+  //
+  // Chunks hold disjoint buckets, so a thief never races with the owner or
+  // another thief on a bucket's particles. Walks resumed after a remote
+  // miss stay with the owner for the same reason: misses of one chunk can
+  // resolve in any order and share buckets.
+  void work() {
+    int budget = yield_after > 0 ? yield_after : std::numeric_limits<int>::max();
+    while (drain(owner_walk, budget)) {
+      if (next_chunk == chunks.size()) {
+        chunks.clear();
+        next_chunk = 0;
+        if (isFinished()) interact();
+        return;
+      }
+      auto& chunk = chunks[next_chunk++];
+      if (part.cm_local->work_pool.claim(*chunk)) {
+        push(owner_walk, chunk->node, chunk->buckets);
+        n_pending_chunks--;
+      }
+    }
+    if (!yielded) {
+      yielded = true;
+      part.thisProxy[part.thisIndex].goDown();
+    }
+  }
+
+  // Runs on the thief's PE
+  void runStolen(Node<Data>* node, BucketSet buckets) {
+    static thread_local TraversalArenas<Word> thief_arenas;
+    static thread_local std::vector<Frame> thief_stack;
+    std::vector<Miss> misses;
+    Walk thief_walk {&part.r_proxy.ckLocalBranch()->stats, thief_arenas, thief_stack, &misses};
+    thief_arenas.reset();
+    int budget = std::numeric_limits<int>::max();
+    push(thief_walk, node, buckets);
+    drain(thief_walk, budget);
+    {
+      std::lock_guard<std::mutex> guard(stolen_lock);
+      stolen_misses.push_back(std::move(misses));
+    }
+    part.thisProxy[part.thisIndex].adoptStolen();
+  }
+
+  // Takes over the remote misses of finished stolen chunks
+  virtual void adoptStolen() override {
+    std::vector<std::vector<Miss>> finished;
+    {
+      std::lock_guard<std::mutex> guard(stolen_lock);
+      finished.swap(stolen_misses);
+    }
+    for (auto && misses : finished) {
+      n_pending_chunks--;
+      for (auto && miss : misses) {
+        auto node = part.cm_local->findNode(miss.first);
+        CkAssert(node && node->key == miss.first);
+        push(owner_walk, node, BucketSet::fromList(numSlots(), miss.second, arenas.waiting));
+      }
+    }
+    work();
+  }
+
+  int numSlots() const {return group_walk ? groups.numTargets() : leaves.size() * nv;}
+
+  // Buckets with at least one active slot; a node is only finished for a
+  // bucket once every visitor is done with it
+  static int countBuckets(const BucketSet& set) {
+    if (nv == 1) return set.count();
+    int n_buckets = 0, last = -1;
+    set.forEach([&](int slot) {
+      if (slot / nv != last) {
+        last = slot / nv;
+        n_buckets++;
+      }
+    });
+    return n_buckets;
+  }
+
+  void push(Walk& walk, Node<Data>* start_node, BucketSet start_buckets) {
+    walk.stack.push_back({start_node, start_buckets, walk.arenas.scratch.mark()});
   }
-  virtual void interact() override {this->template interactBase<Visitor> (part);}
-  void recurse(Node<Data>* node, std::vector<int>& active_buckets) {
+
+  // Returns false if the budget ran out before the stack did
+  bool drain(Walk& walk, int& budget) {
+    auto& arena = walk.arenas.scratch;
+    while (!walk.stack.empty()) {
+      if (budget == 0) return false;
+      Frame frame = walk.stack.back();
+      walk.stack.pop_back();
+      if (!frame.node) {
+        arena.rewind(frame.release);
+        continue;
+      }
+      if (group_walk) visitGroups(walk, frame.node, frame.active);
+      else visit(walk, frame.node, frame.active);
+      budget--;
+    }
+    return true;
+  }
+
+  void visit(Walk& walk, Node<Data>* node, BucketSet active_buckets) {
     CkAssert(node);
-    std::vector<int> new_active_buckets;
-    new_active_buckets.reserve(leaves.size());
 #if DEBUG
     CkPrintf("tp %d, key = 0x%" PRIx64 ", type = %d, pe %d\n", part.thisIndex, node->key, node->type, CkMyPe());
 #endif
@@ -119,13 +431,14 @@ public:
       case Node<Data>::Type::CachedRemoteLeaf:
         {
           // Store local and remote cached leaves for interactions
-          for (auto bucket : active_buckets) {
-            if (Visitor::CallSelfLeaf || leaves[bucket]->key != node->key) {
-              if (delay_leaf) part.interactions[bucket].push_back(node);
-              else doLeaf<Visitor>(node, leaves[bucket], part.r_local);
+          active_buckets.forEach([&](int slot) {
+            const int bucket = slot / nv, v = slot % nv;
+            if (Slots::callSelfLeaf(v) || leaves[bucket]->key != node->key) {
+              if (deferred) part.interactions.addLeaf(slot, node);
+              else doLeaf<Visitor>(v, node, leaves[bucket], walk.stats);
             }
-          }
-          if (!delay_leaf) node->finish(active_buckets.size());
+          });
+          if (!deferred) node->finish(countBuckets(active_buckets));
           break;
         }
       case Node<Data>::Type::Internal:
@@ -134,16 +447,31 @@ public:
         {
           // Check if the opening condition is fulfilled
           // If so, need to go down deeper
-          for (auto bucket : active_buckets) {
-            const bool should_open = doOpen<Visitor>(node, leaves[bucket], part.r_local);
+          auto& arena = walk.arenas.scratch;
+          auto release = arena.mark();
+          BucketSet new_active_buckets = active_buckets.filter(arena, [&](int slot) {
+            const int bucket = slot / nv, v = slot % nv;
+            const bool should_open = doOpen<Visitor>(v, node, leaves[bucket], walk.stats);
             if (should_open) {
-              new_active_buckets.push_back(bucket);
+              return true;
+            } else if (deferred) {
+              part.interactions.addNode(slot, node);
             } else {
-              // maybe delay as an interaction
-              doNode<Visitor>(node, leaves[bucket], part.r_local);
+              doNode<Visitor>(v, node, leaves[bucket], walk.stats);
             }
+            return false;
+          });
+          if (!deferred) node->finish(countBuckets(active_buckets) - countBuckets(new_active_buckets));
+          if (new_active_buckets.count() == 0) {
+            arena.rewind(release);
+            break;
+          }
+          // Children share the new set; it is released once all of them
+          // are done. Pushed in reverse to keep the recursive visit order.
+          walk.stack.push_back({nullptr, new_active_buckets, release});
+          for (int idx = node->n_children - 1; idx >= 0; idx--) {
+            walk.stack.push_back({node->getChild(idx), new_active_buckets, release});
           }
-          node->finish(active_buckets.size() - new_active_buckets.size());
           break;
         }
       case Node<Data>::Type::Boundary:
@@ -151,27 +479,94 @@ public:
       case Node<Data>::Type::Remote:
       case Node<Data>::Type::RemoteLeaf:
         {
-          curr_nodes[node->key] = active_buckets;
-
-          // Submit a request if the node wasn't requested before
-          bool prev = node->requested.exchange(true);
-          if (!prev) {
-            if (node->type == Node<Data>::Type::Boundary || node->type == Node<Data>::Type::RemoteAboveTPKey) {
-              // Ask TreeCanopy for data
-              // If the canopy is at the same level as a TP, it asks the TP
-              // which eventually calls CacheManager::serviceRequest
-              // If the canopy is above TPs, it directly calls
-              // CacheManager::restoreData which fills in the cache
-              part.tc_proxy[node->key].requestData(part.cm_local->thisIndex);
-            }
-            else {
-              // The node is entirely remote, ask CacheManager for data
-              part.cm_proxy[node->cm_index].requestNodes(std::make_pair(node->key, part.cm_local->thisIndex));
-            }
+          wait(walk, node, active_buckets);
+          break;
+        }
+      default:
+        {
+          break;
+        }
+    }
+  }
+  // Parks the active set on a remote node until its data arrives
+  void wait(Walk& walk, Node<Data>* node, BucketSet active_buckets) {
+    // Submit a request if the node wasn't requested before
+    this->requestNode(part, node, walk.stats);
+    if (walk.misses) {
+      // Stolen walk: hand the buckets back to the owner
+      std::vector<int> buckets;
+      active_buckets.forEach([&](int bucket) {buckets.push_back(bucket);});
+      walk.misses->emplace_back(node->key, std::move(buckets));
+      return;
+    }
+    // The scratch set is recycled as the walk unwinds, so keep a copy
+    // that lives until the end of the iteration
+    auto& waiting_sets = curr_nodes[node->key];
+    waiting_sets.push_back(active_buckets.copy(arenas.waiting));
+    if (waiting_sets.size() == 1) {
+      // Add the Partition that initiated the traversal to the waiting list
+      // maintained in Resumer
+      part.r_local->waitersOf(node->key).push_back(part.thisIndex);
+    }
+  }
+
+  // Group walk visit. A group is tested against the node as a whole; if it
+  // does not open the node then neither does any of its buckets, which
+  // requires the visitor's open() to be monotone in the target's extent
+  // (true of box based criteria like Gravity's). A group that opens the
+  // node is split into its children, and is kept whole for the node's
+  // children only if all of them open it too.
+  template <typename Targets>
+  void visitGroups(Walk& walk, Node<Data>* node, Targets active_targets) {
+    CkAssert(node);
+    switch (node->type) {
+      case Node<Data>::Type::Leaf:
+      case Node<Data>::Type::CachedRemoteLeaf:
+        {
+          int n_buckets = 0;
+          active_targets.forEach([&](int target) {
+            groups.forEachBucket(target, [&](int bucket) {
+              if (Slots::callSelfLeaf(0) || leaves[bucket]->key != node->key) {
+                if (deferred) part.interactions.addLeaf(bucket, node);
+                else doLeaf<Visitor>(0, node, leaves[bucket], walk.stats);
+              }
+              n_buckets++;
+            });
+          });
+          if (!deferred) node->finish(n_buckets);
+          break;
+        }
+      case Node<Data>::Type::Internal:
+      case Node<Data>::Type::CachedBoundary:
+      case Node<Data>::Type::CachedRemote:
+        {
+          auto& arena = walk.arenas.scratch;
+          auto release = arena.mark();
+          // Entries never overlap, so there are at most as many as buckets
+          BucketList opened {arena.allocate(leaves.size()), 0};
+          int n_closed = 0;
+          active_targets.forEach([&](int target) {
+            testTarget(walk, node, target, opened, n_closed);
+          });
+          if (!deferred) node->finish(n_closed);
+          // Give back the unused tail of the list
+          arena.rewind(release);
+          if (opened.size == 0) break;
+          auto kept = arena.allocate(opened.size);
+          if (kept != opened.buckets) std::copy(opened.buckets, opened.buckets + opened.size, kept);
+          opened.buckets = kept;
+          walk.stack.push_back({nullptr, opened, release});
+          for (int idx = node->n_children - 1; idx >= 0; idx--) {
+            walk.stack.push_back({node->getChild(idx), opened, release});
           }
-          // Add the Partition that initiated the traversal to the waiting list
-          // maintained in Resumer
-          part.r_local->waiting[node->key].push_back(part.thisIndex);
+          break;
+        }
+      case Node<Data>::Type::Boundary:
+      case Node<Data>::Type::RemoteAboveTPKey:
+      case Node<Data>::Type::Remote:
+      case Node<Data>::Type::RemoteLeaf:
+        {
+          wait(walk, node, active_targets);
           break;
         }
       default:
@@ -179,26 +574,213 @@ public:
           break;
         }
     }
-    if (!new_active_buckets.empty()) {
-      for (int idx = 0; idx < node->n_children; idx++) {
-        recurse(node->getChild(idx), new_active_buckets);
-      }
+  }
+
+  void visitGroups(Walk&, Node<Data>*, BucketBits) {
+    CkAbort("group walks carry bucket lists");
+  }
+
+  // Adds target to opened if it opens node, or else the parts of it that
+  // do; the rest interact with node. Returns whether all of target opened.
+  bool testTarget(Walk& walk, Node<Data>* node, int target, BucketList& opened, int& n_closed) {
+    if (!doOpen<Visitor>(0, node, groups.node(target), walk.stats)) {
+      groups.forEachBucket(target, [&](int bucket) {
+        if (deferred) part.interactions.addNode(bucket, node);
+        else doNode<Visitor>(0, node, leaves[bucket], walk.stats);
+        n_closed++;
+      });
+      return false;
+    }
+    if (!groups.isGroup(target)) {
+      opened.buckets[opened.size++] = target;
+      return true;
     }
+    const int first = opened.size;
+    bool all_opened = true;
+    groups.forEachChild(target, [&](int child) {
+      all_opened &= testTarget(walk, node, child, opened, n_closed);
+    });
+    if (all_opened) {
+      opened.size = first;
+      opened.buckets[opened.size++] = target;
+    }
+    return all_opened;
   }
+
   virtual void resumeTrav() override {
-    auto && resume_nodes = part.r_local->resume_nodes_per_part[part.thisIndex];
-    CkAssert(!resume_nodes.empty()); // nothing to resume on?
-    while (!resume_nodes.empty()) {
-      auto start_node = resume_nodes.front();
-      resume_nodes.pop();
+    yielded = false;
+    // Resumed walks go on top of whatever is left from a yield, the ones
+    // with the most waiting buckets last so that they run first
+    auto ready = this->takeResumeNodes(part, [&](Node<Data>* node) {
+      size_t n_waiting = 0;
+      auto waiting_sets = curr_nodes.find(node->key);
+      if (waiting_sets) {
+        for (auto && buckets : *waiting_sets) n_waiting += buckets.count();
+      }
+      return n_waiting;
+    });
+    for (auto rit = ready.rbegin(); rit != ready.rend(); ++rit) {
+      auto start_node = *rit;
       auto key = start_node->key;
 #if DEBUG
       CkPrintf("going down on key %d while its type is %d\n", key, start_node->type);
 #endif
-      auto& now_ready = curr_nodes[key];
-      recurse(start_node, now_ready);
+      auto waiting_sets = curr_nodes.find(key);
+      if (!waiting_sets) continue;
+      auto now_ready = std::move(*waiting_sets);
       curr_nodes.erase(key);
+      for (auto && buckets : now_ready) push(owner_walk, start_node, buckets);
     }
+    work();
+  }
+};
+
+template <typename Data, typename Visitor>
+class ReplayTraverser : public Traverser<Data> {
+// Evaluates the lists saved by the last recording walk again on this
+// iteration's tree instead of walking it. Sources are looked up by key and
+// fetched when remote. The lists are only reused if the buckets are the
+// same, every bucket has stayed within half the recording skin of its
+// recorded box, every node source has its particle count and its box, and
+// its centroid and radius within the other half (SavedInteractions::moved),
+// and every source still exists with the same role. That bounds opening
+// criteria that test the bucket box against the source box or against the
+// ball of the source's rsq around its centroid. Otherwise the Partition walks
+// again, recording new lists.
+private:
+  Partition<Data>& part;
+  SavedInteractions& saved;
+  paratreet::TraversalOptions options;
+  KeyMap<Node<Data>*> resolved;        // source key -> node, nullptr while fetching
+  KeyMap<SmallVector<Key, 4>> blocked; // remote node key -> source keys below it
+  bool valid = true;
+  std::unique_ptr<Traverser<Data>> walk; // the fallback walk, if any
+
+public:
+  ReplayTraverser(Partition<Data>& parti, const paratreet::TraversalOptions& optionsi)
+    : part(parti), saved(parti.saved_interactions), options(optionsi) {}
+  virtual ~ReplayTraverser() = default;
+  virtual bool isFinished() override {return walk ? walk->isFinished() : blocked.empty();}
+  virtual void interact() override {if (walk) walk->interact();}
+  virtual void adoptStolen() override {if (walk) walk->adoptStolen();}
+
+  virtual void start() override {
+    valid = bucketsStayed();
+    for (int i = 0; valid && i < saved.sources.size(); i++) {
+      const Key key = saved.sources[i];
+      if (resolved.find(key)) continue;
+      resolved[key] = nullptr;
+      resolve(key, part.cm_local->root);
+    }
+    finishIfResolved();
+  }
+
+  virtual void resumeTrav() override {
+    if (walk) {
+      walk->resumeTrav();
+      return;
+    }
+    auto ready = this->takeResumeNodes(part, [&](Node<Data>* node) {
+      auto keys = blocked.find(node->key);
+      return keys ? keys->size() : 0;
+    });
+    for (auto node : ready) {
+      auto keys = blocked.find(node->key);
+      if (!keys) continue;
+      auto waiting_keys = std::move(*keys);
+      blocked.erase(node->key);
+      for (auto key : waiting_keys) {
+        if (valid) resolve(key, node);
+      }
+    }
+    finishIfResolved();
+  }
+
+private:
+  static bool isRemote(const Node<Data>* node) {
+    return node->type == Node<Data>::Type::Boundary
+        || node->type == Node<Data>::Type::RemoteAboveTPKey
+        || node->type == Node<Data>::Type::Remote
+        || node->type == Node<Data>::Type::RemoteLeaf;
+  }
+
+  bool bucketsStayed() const {
+    if (saved.empty() || saved.bucket_keys.size() != part.targets.size()) return false;
+    for (int b = 0; b < part.targets.size(); b++) {
+      auto leaf = part.targets[b];
+      if (leaf->key != saved.bucket_keys[b] || saved.moved(saved.bucket_boxes[b], leaf->data.box)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Follows key down from node; parks it on the first remote node in the
+  // way, or invalidates the lists if the tree no longer has it
+  void resolve(Key key, Node<Data>* node) {
+    const Key branch_factor = node->getBranchFactor();
+    while (node->key != key) {
+      if (isRemote(node)) break;
+      Key child_key = key;
+      while (child_key / branch_factor > node->key) child_key /= branch_factor;
+      const int idx = child_key - node->key * branch_factor;
+      Node<Data>* child = (child_key / branch_factor == node->key && idx < node->n_children) ? node->getChild(idx) : nullptr;
+      if (!child) {
+        valid = false;
+        return;
+      }
+      node = child;
+    }
+    if (isRemote(node)) {
+      this->requestNode(part, node, &part.stats);
+      auto& keys = blocked[node->key];
+      if (keys.empty()) part.r_local->waitersOf(node->key).push_back(part.thisIndex);
+      keys.push_back(key);
+      return;
+    }
+    resolved[key] = node;
+  }
+
+  bool sourcesStayed() {
+    for (int b = 0; b < saved.bucket_keys.size(); b++) {
+      for (int i = saved.offsets[b]; i < saved.leaf_offsets[b]; i++) {
+        auto node = *resolved.find(saved.sources[i]);
+        auto recorded = saved.node_sources.find(saved.sources[i]);
+        if ((node->n_particles > 0 || recorded->n_particles > 0) && saved.moved(*recorded, node)) return false;
+      }
+      for (int i = saved.leaf_offsets[b]; i < saved.offsets[b + 1]; i++) {
+        auto node = *resolved.find(saved.sources[i]);
+        if (node->type != Node<Data>::Type::Leaf && node->type != Node<Data>::Type::CachedRemoteLeaf
+            && node->type != Node<Data>::Type::EmptyLeaf) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  void finishIfResolved() {
+    if (!blocked.empty()) return;
+    if (valid) valid = sourcesStayed();
+    if (!valid) {
+      walk.reset(part.template makeDownTraverser<Visitor>(options));
+      walk->start();
+      return;
+    }
+    for (int b = 0; b < saved.bucket_keys.size(); b++) {
+      auto target = part.targets[b];
+      for (int i = saved.offsets[b]; i < saved.leaf_offsets[b]; i++) {
+        auto node = *resolved.find(saved.sources[i]);
+        doNode<Visitor>(0, node, target, &part.stats);
+        node->finish(1);
+      }
+      for (int i = saved.leaf_offsets[b]; i < saved.offsets[b + 1]; i++) {
+        auto node = *resolved.find(saved.sources[i]);
+        if (node->n_particles > 0) doLeaf<Visitor>(0, node, target, &part.stats);
+        node->finish(1);
+      }
+    }
+    saved.age++;
   }
 };
 
@@ -206,7 +788,7 @@ template <typename Data, typename Visitor>
 class UpnDTraverser : public Traverser<Data> {
 private:
   Partition<Data>& part;
-  std::unordered_map<Key, std::vector<int>> curr_nodes;
+  KeyMap<SmallVector<int, 4>> curr_nodes;
   std::vector<int> num_waiting;
   std::vector<Node<Data>*> trav_tops;
 public:
@@ -229,10 +811,11 @@ public:
   }
 
   virtual void resumeTrav() {
-    auto && resume_nodes = part.r_local->resume_nodes_per_part[part.thisIndex];
-    while (!resume_nodes.empty()) {
-      auto start_node = resume_nodes.front();
-      resume_nodes.pop();
+    auto ready = this->takeResumeNodes(part, [&](Node<Data>* node) {
+      auto waiters = curr_nodes.find(node->key);
+      return waiters ? waiters->size() : 0;
+    });
+    for (auto start_node : ready) {
       auto key = start_node->key;
 #if DEBUG
       CkPrintf("going down on key %d while its type is %d\n", key, start_node->type);
@@ -261,19 +844,19 @@ private:
           case Node<Data>::Type::Leaf:
           case Node<Data>::Type::CachedRemoteLeaf:
             {
-              doLeaf<Visitor>(node, part.leaves[bucket], part.r_local);
+              doLeaf<Visitor>(node, part.leaves[bucket], &part.stats);
               break;
             }
           case Node<Data>::Type::Internal:
           case Node<Data>::Type::CachedBoundary:
           case Node<Data>::Type::CachedRemote:
             {
-              if (doOpen<Visitor>(node, part.leaves[bucket], part.r_local)) {
+              if (doOpen<Visitor>(node, part.leaves[bucket], &part.stats)) {
                 for (int i = 0; i < node->n_children; i++) {
                   nodes.push(node->getChild(i));
                 }
               } else {
-                doNode<Visitor>(node, part.leaves[bucket], part.r_local);
+                doNode<Visitor>(node, part.leaves[bucket], &part.stats);
               }
               break;
             }
@@ -284,13 +867,8 @@ private:
             {
               curr_nodes_insertions.push_back(std::make_pair(node->key, bucket));
               num_waiting[bucket]++;
-              bool prev = node->requested.exchange(true);
-              if (!prev) {
-                if (node->type == Node<Data>::Type::Boundary || node->type == Node<Data>::Type::RemoteAboveTPKey)
-                  part.tc_proxy[node->key].requestData(part.cm_local->thisIndex);
-                else part.cm_proxy[node->cm_index].requestNodes(std::make_pair(node->key, part.cm_local->thisIndex));
-              }
-              std::vector<int>& list = part.r_local->waiting[node->key];
+              this->requestNode(part, node, &part.stats);
+              auto& list = part.r_local->waitersOf(node->key);
               if (!list.size() || list.back() != part.thisIndex) list.push_back(part.thisIndex);
               break;
             }
@@ -329,136 +907,197 @@ private:
   }
 };
 
-/*
 template <typename Data, typename Visitor>
 class DualTraverser : public Traverser<Data> {
-// NOTE: dual traversals dont have leaves they have payloads
-// we start by assigning one payload to each treepiece
-private:
-  Subtree<Data>& tp;
-  std::unordered_map<Key, std::vector<Node<Data>*>> curr_nodes; // source nodes to target nodes
-  std::vector<Key> keys;
+// Source and target trees are descended together. Targets are the largest
+// local nodes whose buckets all belong to this Partition; well separated
+// pairs interact once for every bucket under the target instead of being
+// tested bucket by bucket.
+protected:
+  Partition<Data>& part;
+  KeyMap<SmallVector<Node<Data>*, 4>> curr_nodes; // source key -> waiting targets
+  TargetGroups<Data> targets;
+
 public:
-  DualTraverser(TreePiece<Data>& tpi, std::vector<Key> keysi)
-     : tp(tpi), keys(keysi)
-  { }
-  void start() override {
-    tp.global_root = tp.cm_local->root; // these are source nodes
-    tp.local_root = tp.global_root->getDescendant(tp.tp_key);
-    if (tp.local_root == nullptr) CkAbort("If doing dual traversal, don't set num_share_nodes");
-    for (auto key : keys) curr_nodes[key].push_back(tp.local_root);
-  }
-  virtual void interact() override {this->template interactBase<Visitor>(tp);}
-
-  void runInvertedTraversal(Node<Data>* source_leaf, Node<Data>* target_node)
-  {
+  DualTraverser(Partition<Data>& parti) : part(parti) {
+    targets.build(part.leaves);
+  }
+  virtual ~DualTraverser() = default;
+  virtual bool isFinished() override {return curr_nodes.empty();}
+  virtual void interact() override {this->template interactBase<Visitor>(part);}
+  virtual void start() override {
+    for (auto target : targets.roots()) traverse(part.cm_local->root, targets.node(target));
+  }
+  virtual void resumeTrav() override {
+    auto ready = this->takeResumeNodes(part, [&](Node<Data>* node) {
+      auto waiters = curr_nodes.find(node->key);
+      return waiters ? waiters->size() : 0;
+    });
+    for (auto start_node : ready) {
+      auto waiting_targets = curr_nodes.find(start_node->key);
+      if (!waiting_targets) continue;
+      auto targets = std::move(*waiting_targets);
+      curr_nodes.erase(start_node->key);
+      for (auto target : targets) traverse(start_node, target);
+    }
+  }
+
+protected:
+  bool isBucket(Node<Data>* node) const {return targets.bucketIndex(node) >= 0;}
+
+  // Interaction of a well separated source with a group target
+  virtual void farField(Node<Data>* source, Node<Data>* target) {nodeInteract(source, target);}
+
+  // Far field interaction of source with every bucket under target
+  void nodeInteract(Node<Data>* source, Node<Data>* target) {
     std::stack<Node<Data>*> nodes;
-    nodes.push(target_node);
+    nodes.push(target);
     while (!nodes.empty()) {
       Node<Data>* node = nodes.top();
       nodes.pop();
-      if (node->type == Node<Data>::Type::Leaf || node->type == Node<Data>::Type::CachedRemoteLeaf) {
-        Visitor::leaf(*source_leaf, *node); // why even call leaf() here? maybe just call node.
-      } else {
-        if (Visitor::open(*node, *source_leaf)) {
-          for (int j = 0; j < node->n_children; j++) {
-            nodes.push(node->getChild(j));
-          }
-        } else {
-          Visitor::node(*node, *source_leaf);
-        }
+      if (isBucket(node)) {
+        doNode<Visitor>(source, node, &part.stats);
+        source->finish(1);
+      }
+      else if (node->type == Node<Data>::Type::Internal) {
+        for (int i = 0; i < node->n_children; i++) nodes.push(node->getChild(i));
       }
     }
   }
 
-  virtual void resumeTrav(Key new_key) override {
-    auto& now_ready = curr_nodes[new_key];
-    std::vector<std::pair<Key, Node<Data>*>> curr_nodes_insertions;
-    Node<Data>* start_node = nullptr;
-    auto && resume_nodes = tp.r_local->resume_nodes_per_tp[tp.thisIndex];
-    if (!resume_nodes.empty()) {
-      start_node = resume_nodes.front();
-      CkAssert(start_node->key == new_key);
-      resume_nodes.pop();
+  void pushTargetChildren(std::stack<std::pair<Node<Data>*, Node<Data>*>>& pairs, Node<Data>* source, Node<Data>* target) {
+    for (int i = 0; i < target->n_children; i++) {
+      Node<Data>* child = target->getChild(i);
+      if (child->type != Node<Data>::Type::EmptyLeaf) pairs.emplace(source, child);
     }
-    else {
-      start_node = tp.global_root->getDescendant(new_key);
-      if (start_node == nullptr) CkAbort("If doing dual traversal, don't set num_share_nodes");
+  }
+
+  void pushSourceChildren(std::stack<std::pair<Node<Data>*, Node<Data>*>>& pairs, Node<Data>* source, Node<Data>* target) {
+    for (int i = 0; i < source->n_children; i++) {
+      pairs.emplace(source->getChild(i), target);
     }
-    for (auto new_payload : now_ready) {
-      std::stack<std::pair<Node<Data>*, Node<Data>*>> nodes;
-      nodes.push(std::make_pair(start_node, new_payload));
-      while (nodes.size()) {
-        Node<Data>* node = nodes.top().first, *curr_payload = nodes.top().second;
-        // node is target, payload is source
-        nodes.pop();
+  }
+
+  void traverse(Node<Data>* start_node, Node<Data>* start_target) {
+    std::stack<std::pair<Node<Data>*, Node<Data>*>> pairs;
+    pairs.emplace(start_node, start_target);
+    while (!pairs.empty()) {
+      Node<Data>* node = pairs.top().first, *target = pairs.top().second;
+      pairs.pop();
 #if DEBUG
-        CkPrintf("tp %d, key = %d, type = %d, pe %d\n", tp.thisIndex, node->key, node->type, CkMyPe());
+      CkPrintf("tp %d, key = 0x%" PRIx64 ", target = 0x%" PRIx64 ", type = %d, pe %d\n", part.thisIndex, node->key, target->key, node->type, CkMyPe());
 #endif
-        if (curr_payload->type == Node<Data>::Type::EmptyLeaf) {
-          continue;
-        }
-        else if (curr_payload->type == Node<Data>::Type::Leaf) {
-          int leaf_index = -1;
-          for (int i = 0; i < tp.leaves.size(); i++) {
-            if (tp.leaves[i] == curr_payload) {
-              leaf_index = i;
-              break;
+      const bool target_is_bucket = isBucket(target);
+      switch (node->type) {
+        case Node<Data>::Type::Leaf:
+        case Node<Data>::Type::CachedRemoteLeaf:
+          {
+            if (target_is_bucket) {
+              if (Visitor::CallSelfLeaf || target->key != node->key) {
+                doLeaf<Visitor>(node, target, &part.stats);
+              }
+              node->finish(1);
             }
+            else if (Visitor::cell(*node, *target)) pushTargetChildren(pairs, node, target);
+            else farField(node, target);
+            break;
           }
-          CkAssert(leaf_index != -1);
-          this->template runSimpleTraversal<Visitor>(tp, node, leaf_index);
-          continue;
-        }
-        CkAssert(curr_payload->type == Node<Data>::Type::Internal);
-        switch (node->type) {
-          case Node<Data>::Type::Leaf:
-          case Node<Data>::Type::CachedRemoteLeaf:
-            {
-              runInvertedTraversal(node, curr_payload);
-              break;
-            }
-          case Node<Data>::Type::Internal:
-          case Node<Data>::Type::CachedBoundary:
-          case Node<Data>::Type::CachedRemote:
-            {
-              if (Visitor::cell(*node, *curr_payload)) {
-                for (int i = 0; i < node->n_children; i++) {
-                  for (int j = 0; j < curr_payload->n_children; j++) {
-                    nodes.push(std::make_pair(node->getChild(i), curr_payload->getChild(j)));
-                  }
-                }
+        case Node<Data>::Type::Internal:
+        case Node<Data>::Type::CachedBoundary:
+        case Node<Data>::Type::CachedRemote:
+          {
+            if (target_is_bucket) {
+              if (doOpen<Visitor>(node, target, &part.stats)) pushSourceChildren(pairs, node, target);
+              else {
+                doNode<Visitor>(node, target, &part.stats);
+                node->finish(1);
               }
-              break;
             }
-          case Node<Data>::Type::Boundary:
-          case Node<Data>::Type::RemoteAboveTPKey:
-          case Node<Data>::Type::Remote:
-          case Node<Data>::Type::RemoteLeaf:
-            {
-              curr_nodes_insertions.push_back(std::make_pair(node->key, curr_payload));
-              bool prev = node->requested.exchange(true);
-              if (!prev) {
-                if (node->type == Node<Data>::Type::Boundary || node->type == Node<Data>::Type::RemoteAboveTPKey)
-                  tp.tc_proxy[node->key].requestData(tp.cm_local->thisIndex);
-                else tp.cm_proxy[node->cm_index].requestNodes(std::make_pair(node->key, tp.cm_local->thisIndex));
-              }
-              std::vector<int>& list = tp.r_local->waiting[node->key];
-              if (!list.size() || list.back() != tp.thisIndex) list.push_back(tp.thisIndex);
-              break;
-            }
-          default:
-            {
-              break;
-            }
-        }
+            else if (!Visitor::cell(*node, *target)) farField(node, target);
+            // Split the larger (shallower) of the two nodes
+            else if (node->depth <= target->depth) pushSourceChildren(pairs, node, target);
+            else pushTargetChildren(pairs, node, target);
+            break;
+          }
+        case Node<Data>::Type::Boundary:
+        case Node<Data>::Type::RemoteAboveTPKey:
+        case Node<Data>::Type::Remote:
+        case Node<Data>::Type::RemoteLeaf:
+          {
+            auto& waiting_targets = curr_nodes[node->key];
+            bool first_wait = waiting_targets.empty();
+            waiting_targets.push_back(target);
+            // Every waiting target is a miss; requestNode sends once per node
+            this->requestNode(part, node, &part.stats);
+            if (first_wait) part.r_local->waitersOf(node->key).push_back(part.thisIndex);
+            break;
+          }
+        default:
+          {
+            break;
+          }
       }
     }
-    curr_nodes.erase(new_key);
-    for (auto cn : curr_nodes_insertions) curr_nodes[cn.first].push_back(cn.second);
-    if (!resume_nodes.empty()) traverse(resume_nodes.front()->key); 
   }
 };
-*/
+
+template <typename Data, typename Visitor>
+class FmmTraverser : public DualTraverser<Data, Visitor> {
+// Fast multipole mode of the dual walk. A well separated source is
+// converted into the local expansion of the group target (M2L) when
+// Visitor::useLocal() accepts the pair, and into per-bucket node
+// interactions otherwise. Once the walk is done the expansions are shifted
+// down the target groups (L2L) and evaluated on the buckets' particles
+// (L2P). Visitor supplies the Local type and the m2l, l2l and l2p kernels.
+private:
+  using Local = typename Visitor::Local;
+  std::vector<Local> locals; // by target number
+  bool evaluated = false;
+
+public:
+  FmmTraverser(Partition<Data>& parti)
+    : DualTraverser<Data, Visitor>(parti), locals(this->targets.numTargets())
+  {
+  }
+  virtual ~FmmTraverser() = default;
+  virtual void start() override {
+    DualTraverser<Data, Visitor>::start();
+    if (this->isFinished()) evaluate();
+  }
+  virtual void resumeTrav() override {
+    DualTraverser<Data, Visitor>::resumeTrav();
+    if (this->isFinished()) evaluate();
+  }
+
+private:
+  virtual void farField(Node<Data>* source, Node<Data>* target) override {
+    if (!Visitor::useLocal(*source, *target)) {
+      this->nodeInteract(source, target);
+      return;
+    }
+    const int t = this->targets.targetIndex(target);
+    CkAssert(t >= 0);
+    Visitor::m2l(*source, *target, locals[t]);
+    source->finish(this->targets.numBucketsUnder(t));
+  }
+
+  void evaluate() {
+    if (evaluated) return;
+    evaluated = true;
+    for (auto root : this->targets.roots()) passDown(root);
+  }
+
+  void passDown(int target) {
+    Node<Data>* node = this->targets.node(target);
+    if (!this->targets.isGroup(target)) {
+      Visitor::l2p(locals[target], *node);
+      return;
+    }
+    this->targets.forEachChild(target, [&](int child) {
+      Visitor::l2l(locals[target], *this->targets.node(child), locals[child]);
+      passDown(child);
+    });
+  }
+};
 
 #endif // PARATREET_TRAVERSER_H_
@@ -73,8 +73,12 @@ void TreeCanopy<Data>::recvData(SpatialNode<Data> child, int branch_factor) {
 
 template <typename Data>
 void TreeCanopy<Data>::requestData(int cm_index) {
-  if (tp_index >= 0) tp_proxy[tp_index].requestNodes(this->thisIndex, cm_index);
-  else cm_proxy[cm_index].restoreData(std::make_pair(this->thisIndex, my_sn));
+  // Keep the priority the requester gave this fetch
+  const int branch_factor = treespec.ckLocalBranch()->getTree()->getBranchFactor();
+  const int depth = Utility::getDepthFromKey(this->thisIndex, Utility::mssb64_pos(branch_factor));
+  auto opts = CacheManager<Data>::fetchOptions(depth);
+  if (tp_index >= 0) tp_proxy[tp_index].requestNodes(this->thisIndex, cm_index, &opts);
+  else cm_proxy[cm_index].restoreData(std::make_pair(this->thisIndex, my_sn), &opts);
 }
 
 template <typename Data>
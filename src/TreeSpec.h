@@ -36,21 +36,48 @@ public:
       }
     }
 
+    // Bytes of a node made by makeCachedNode
     template <typename Data>
-    Node<Data>* makeCachedNode(Key key, typename Node<Data>::Type type, SpatialNode<Data> spatial_node, Node<Data>* parent, const Particle* particlesToCopy) {
+    size_t cachedNodeSize() {
+      switch (getTree()->getBranchFactor()) {
+      case 2:
+        return sizeof(FullNode<Data, 2>);
+      case 8:
+        return sizeof(FullNode<Data, 8>);
+      default:
+        return 0;
+      }
+    }
+
+    // With a particle_buffer, a leaf uses particlesToCopy in place and
+    // keeps the buffer alive instead of copying them. With storage, the
+    // node is constructed there (of cachedNodeSize() bytes).
+    template <typename Data>
+    Node<Data>* makeCachedNode(Key key, typename Node<Data>::Type type, SpatialNode<Data> spatial_node, Node<Data>* parent, const Particle* particlesToCopy, std::shared_ptr<void> particle_buffer = nullptr, void* storage = nullptr) {
       Particle* particles = nullptr;
-      if (spatial_node.is_leaf && spatial_node.n_particles > 0) {
+      const bool has_particles = spatial_node.is_leaf && spatial_node.n_particles > 0;
+      if (has_particles && particle_buffer) {
+        particles = const_cast<Particle*>(particlesToCopy);
+      }
+      else if (has_particles) {
         particles = new Particle [spatial_node.n_particles];
         std::copy(particlesToCopy, particlesToCopy + spatial_node.n_particles, particles);
       }
+      Node<Data>* node = nullptr;
       switch (getTree()->getBranchFactor()) {
       case 2:
-        return new FullNode<Data, 2> (key, type, spatial_node.is_leaf, spatial_node, particles, parent);
+        node = storage ? new (storage) FullNode<Data, 2> (key, type, spatial_node.is_leaf, spatial_node, particles, parent)
+                       : new FullNode<Data, 2> (key, type, spatial_node.is_leaf, spatial_node, particles, parent);
+        break;
       case 8:
-        return new FullNode<Data, 8> (key, type, spatial_node.is_leaf, spatial_node, particles, parent);
+        node = storage ? new (storage) FullNode<Data, 8> (key, type, spatial_node.is_leaf, spatial_node, particles, parent)
+                       : new FullNode<Data, 8> (key, type, spatial_node.is_leaf, spatial_node, particles, parent);
+        break;
       default:
         return nullptr;
       }
+      if (has_particles) node->particle_buffer = std::move(particle_buffer);
+      return node;
     }
 
     void reset() {
@@ -0,0 +1,67 @@
+#ifndef PARATREET_WORKPOOL_H_
+#define PARATREET_WORKPOOL_H_
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// A piece of traversal work that either its owner or an idle PE runs.
+// Whoever wins claim() runs it; the other side just drops its reference.
+class StealableWork {
+public:
+  virtual ~StealableWork() = default;
+  bool claim() {return !claimed.exchange(true);}
+  virtual void run() = 0;
+
+private:
+  std::atomic<bool> claimed = ATOMIC_VAR_INIT(false);
+};
+
+// Process-wide pool of published work, kept in the CacheManager so that
+// thieves see the same cached tree as the owner. Owners run their work
+// front to back; thieves take from the back. Work the owner claimed stays
+// in items until a thief pops it, but no longer counts as stealable.
+class WorkPool {
+public:
+  void publish(std::shared_ptr<StealableWork> work) {
+    std::lock_guard<std::mutex> guard(lock);
+    items.push_back(std::move(work));
+    n_items.fetch_add(1, std::memory_order_release);
+  }
+
+  // Owner and thieves both claim through here, so that n_items only
+  // counts unclaimed work
+  bool claim(StealableWork& work) {
+    if (!work.claim()) return false;
+    n_items.fetch_sub(1, std::memory_order_release);
+    return true;
+  }
+
+  // Lock-free hint for idle PEs; a stale answer only delays a steal
+  bool empty() const {return n_items.load(std::memory_order_acquire) == 0;}
+
+  std::shared_ptr<StealableWork> steal() {
+    std::lock_guard<std::mutex> guard(lock);
+    std::shared_ptr<StealableWork> stolen;
+    while (!stolen && !items.empty()) {
+      auto work = std::move(items.back());
+      items.pop_back();
+      if (claim(*work)) stolen = std::move(work);
+    }
+    return stolen;
+  }
+
+  void clear() {
+    std::lock_guard<std::mutex> guard(lock);
+    items.clear();
+    n_items.store(0, std::memory_order_release);
+  }
+
+private:
+  std::mutex lock;
+  std::vector<std::shared_ptr<StealableWork>> items;
+  std::atomic<size_t> n_items = ATOMIC_VAR_INIT(0); // unclaimed
+};
+
+#endif // PARATREET_WORKPOOL_H_
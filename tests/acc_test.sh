@@ -10,12 +10,12 @@ testname="lambs.00200_subsamp_30K"
 echo "Running ParaTreeT..."
 if [[ $hostname == *"lassen"* ]]; then
   # LLNL Lassen
-  jsrun -n2 -a1 -c20 -K1 -r2 ../examples/simple/Main -f $testname -v +ppn 20 +pemap L0-76:4,80-156:4 &> $testname.out
+  jsrun -n2 -a1 -c20 -K1 -r2 ../examples/simple/Gravity -f $testname -v $testname +ppn 20 +pemap L0-76:4,80-156:4 &> $testname.out
 elif [[ $hostname == *"batch"* ]]; then
   # OLCF Summit
-  jsrun -n2 -a1 -c21 -K1 -r2 ../examples/simple/Main -f $testname -v +ppn 21 +pemap L0-164:4 &> $testname.out
+  jsrun -n2 -a1 -c21 -K1 -r2 ../examples/simple/Gravity -f $testname -v $testname +ppn 21 +pemap L0-164:4 &> $testname.out
 else
-  ../examples/simple/charmrun ../examples/simple/Main +p 4 -f $testname -v +ppn 2 +setcpuaffinity &> $testname.out
+  ../examples/simple/charmrun ../examples/simple/Gravity +p 4 -f $testname -v $testname +ppn 2 +setcpuaffinity &> $testname.out
 fi
 
 echo -e "\nBuilding and running array utility..."
@@ -34,6 +34,9 @@ echo -e "\nRMS relative force error:"
 echo "Maximum relative force error:"
 ./array/maxarr < rdiff.acc
 
+echo -e "\nTiming:"
+grep -E "^(Tree traversal|Iteration [0-9]+ time):" $testname.out
+
 echo -e "\nCleaning up array utility..."
 cd array
 make clean > /dev/null
@@ -0,0 +1,86 @@
+#!/bin/bash
+# Checks that every traversal mode gives the forces of the plain top-down walk
+
+testname="lambs.00200_subsamp_30K"
+gravity="../examples/simple/charmrun ../examples/simple/Gravity +p 4 +ppn 2 +setcpuaffinity"
+gravity_serial="../examples/simple/charmrun ../examples/simple/Gravity +p 1"
+status=0
+
+echo "Testing traversal modes in ParaTreeT against the plain top-down walk"
+
+echo -e "\nBuilding array utility..."
+cd array
+make > /dev/null
+cd ..
+
+# run <name> <flags>: writes modes.<name>.acc
+run() {
+  name=$1
+  shift
+  $gravity -f $testname -v modes.$name "$@" &> modes.$name.out
+}
+
+# run_serial <name> <flags>: the same on one PE, where no node is remote
+run_serial() {
+  name=$1
+  shift
+  $gravity_serial -f $testname -v modes.$name "$@" &> modes.$name.out
+}
+
+# compare <name> <reference> <max rms> <max error>: relative differences
+compare() {
+  ./array/subarr modes.$1.acc modes.$2.acc > modes.diff.acc
+  ./array/magvec < modes.diff.acc > modes.magdiff.arr
+  ./array/magvec < modes.$2.acc > modes.mag.acc
+  ./array/divarr modes.magdiff.arr modes.mag.acc > modes.rdiff.acc
+  rms=`./array/rmsarr < modes.rdiff.acc`
+  max=`./array/maxarr < modes.rdiff.acc`
+  if awk "BEGIN {exit !($rms <= $3 && $max <= $4)}"; then
+    result="ok"
+  else
+    result="FAILED"
+    status=1
+  fi
+  printf "%-10s vs %-10s RMS %-12.4g max %-12.4g %s\n" $1 $2 $rms $max $result
+}
+
+echo -e "\nRunning ParaTreeT..."
+run plain
+run deferred -D
+run bits -B
+run steal -S 4
+run yield -Y 64
+run group -W
+run fused -C
+run dual -T
+run fmm -F
+# Replayed steps only differ from a walk once the particles have moved
+run plain2 -i 3 -o 2
+run replay -i 3 -o 2 -R 3 -K 0.01
+# Same tree on both, so only the cached copies of remote nodes differ
+run periodic -e -n 16 -p 16
+run_serial periodic1 -e -n 16 -p 16
+
+echo -e "\nRelative force differences:"
+# These only reorder the same interactions
+compare deferred plain 1e-5 1e-4
+compare bits plain 1e-5 1e-4
+compare steal plain 1e-5 1e-4
+compare yield plain 1e-5 1e-4
+compare group plain 1e-5 1e-4
+# Collision search in the same walk must leave the gravity untouched
+compare fused plain 1e-5 1e-4
+# Replay reuses the previous step's lists; expect opening-criterion level errors
+compare replay plain2 1e-3 3e-2
+# The dual walk opens on node pairs and FMM adds expansion errors
+compare dual plain 1e-3 3e-2
+compare fmm plain 1e-3 3e-2
+# Periodic forces, Ewald part included, must not depend on what is remote
+compare periodic periodic1 1e-5 1e-4
+
+echo -e "\nCleaning up..."
+rm -f modes.*
+cd array
+make clean > /dev/null
+
+exit $status